@@ -31,23 +31,50 @@
 #include <string.h>
 #include <signal.h>
 #include <stdint.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/random.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#undef BLOCK_SIZE // linux/fs.h, pulled in by linux/io_uring.h, has its own
 
 #define BLOCK_SIZE 1024 // The filesystem block size shall be 1024 bytes.
 #define NUM_BLOCKS 65536 // The filesystem shall have 65536 blocks
 #define BLOCKS_PER_FILE 1024 // define number of blocks per file
 #define NUM_FILES 256 // The filesystem shall support up to 256 files.
-#define FIRST_DATA_BLOCK 1001
+#define FREE_INODE_MAP 19 // block holding the free inode map
+#define FIRST_INODE_BLOCK 20 // 256 inodes of 4104 bytes each take blocks 20-1045
+#define FREE_BLOCK_MAP 1046 // one byte per data block, blocks 1046-1109
+#define FIRST_DATA_BLOCK 1110
+#define NUM_DATA_BLOCKS (NUM_BLOCKS - FIRST_DATA_BLOCK)
 #define MAX_FILE_SIZE 1048576
 #define MAX_NAME_SIZE 30
 #define HIDDEN 0x1
 #define READONLY 0x2
-uint8_t data [NUM_BLOCKS][BLOCK_SIZE]; //declare data
+#define INLINE 0x4 // the file's bytes are stored in its inode instead of data blocks
+#define ENCRYPTED 0x8 // the file's bytes are stored encrypted
+uint8_t image_memory [NUM_BLOCKS][BLOCK_SIZE] __attribute__((aligned(4096))); // private copy of the image, page aligned for O_DIRECT
+uint8_t (*data) [BLOCK_SIZE] = image_memory; //declare data, the image being worked on
+uint8_t (*image_buffer) [BLOCK_SIZE] = image_memory; // private copy of the image open, see mountOpen
 uint8_t * free_blocks;
 uint8_t * free_inodes;
 
 // define entry structure
 struct _directoryEntry {
-  char filename[64];
+  char filename[48];
+  uint8_t salt[16]; // makes the key of an encrypted file its own
   short in_use;
   int32_t inode;
 }; struct _directoryEntry * directory;
@@ -63,8 +90,16 @@ struct inode{
 FILE *file;
 char image_name[64];
 uint8_t image_open;
+int image_read_only = 0; // open read-only: data maps the image file shared unless compact
+int image_lock = -1;     // lock file held while the image is open for writing
+int image_compact = 0;   // the image file is a compact image, see compactWrite
 int show_hidden = 0;
 int show_attributes = 0;
+int exit_status = 0; // exit status of one-shot mode
+int one_shot = 0;    // running the one command given on the command line
+// Commands run holding image_mutex, at the prompt and in one-shot mode alike; the
+// autosave thread and background readers take it to touch the image.
+pthread_mutex_t image_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 
 #define WHITESPACE " \t\n"      // We want to split our command line up into tokens
@@ -74,10 +109,10 @@ int show_attributes = 0;
 
 #define MAX_COMMAND_SIZE 255    // The maximum command-line size
 
-#define MAX_NUM_ARGUMENTS 5     // only supports four arguments
+#define MAX_NUM_ARGUMENTS 64    // command plus up to 63 arguments (bulk insert takes many paths)
 
 int32_t findFreeBlock(){
-  for (int i = 0; i < NUM_BLOCKS; i++){
+  for (int i = 0; i < NUM_DATA_BLOCKS; i++){
     if (free_blocks[i]){
       return i + FIRST_DATA_BLOCK;
     }
@@ -85,6 +120,11 @@ int32_t findFreeBlock(){
   return -1;
 }
 
+// Metadata blocks and data blocks that are not free.
+int blockInUse(int32_t block_index){
+  return block_index < FIRST_DATA_BLOCK || !free_blocks[block_index - FIRST_DATA_BLOCK];
+}
+
 int32_t findFreeInode(){
   for (int i = 0; i < NUM_FILES; i++){
     if (free_inodes[i]){
@@ -103,606 +143,5884 @@ int32_t findFreeInodeBlock(int32_t inode){
   return -1;
 }
 
-void initialization () {
-  directory = (struct _directoryEntry*)&data[0][0];
-  inodes = (struct inode *)&data[20][0];
-  free_blocks = (uint8_t *)&data[1000][0];
-  free_inodes = (uint8_t *)&data[19][0];
-  memset(image_name,0,64);
-  image_open = 0;
-  for (int i = 0; i < NUM_FILES; i++){
-    directory[i].in_use = 0;
-    directory[i].inode = -1;
-    free_inodes[i] = 1;
-    memset(directory[i].filename, 0, 64);
-    for (int j = 0; j < NUM_BLOCKS; j++){
-      inodes[i].blocks[j] = -1;
-      inodes[i].in_use = 0;
-      inodes[i].attribute = 0;
-      inodes[i].file_size = 0;
+// Read iovcnt buffers starting at offset, resuming after short reads.
+// Returns the number of bytes read, which is less than asked only at end of file.
+ssize_t preadvFull(int fd, struct iovec * iov, int iovcnt, off_t offset){
+  ssize_t total = 0;
+  while (iovcnt > 0) {
+    ssize_t bytes = preadv(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt, offset);
+    if (bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (bytes == 0) {
+      break;
+    }
+    total += bytes;
+    offset += bytes;
+    // skip the buffers that were filled and trim the one that was filled partially
+    while (iovcnt > 0 && (size_t) bytes >= iov->iov_len) {
+      bytes -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (uint8_t *) iov->iov_base + bytes;
+      iov->iov_len -= bytes;
     }
   }
-  for (int j = 0; j < NUM_BLOCKS; j++){
-    free_blocks[j] = 1;
-  }  
+  return total;
 }
-// Retrieve a file from the file system.
-void retrievefs(char * filename, char * newfilename){
-  // Get the file metadata using the stat function
-  struct stat buf;
-  int ret = stat (filename, &buf);
-  if (ret == -1) {
-    perror("File does not exist\n");
-    return;
+
+// Same as preadvFull for writes.
+ssize_t pwritevFull(int fd, struct iovec * iov, int iovcnt, off_t offset){
+  ssize_t total = 0;
+  while (iovcnt > 0) {
+    ssize_t bytes = pwritev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt, offset);
+    if (bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    total += bytes;
+    offset += bytes;
+    while (iovcnt > 0 && (size_t) bytes >= iov->iov_len) {
+      bytes -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (uint8_t *) iov->iov_base + bytes;
+      iov->iov_len -= bytes;
+    }
   }
-  
-  // Search for the file in the file system directory
-  int32_t inode_index = -1;
-  for (int i = 0; i < NUM_FILES; i++) {
-    // If the file name matches and it's in use, get its inode index
-    if (strcmp(directory[i].filename, filename) == 0 && directory[i].in_use) {
-      inode_index = directory[i].inode;
-      break;
+  return total;
+}
+
+int32_t findDirectoryEntry(char * filename){
+  for (int i = 0; i < NUM_FILES; i++){
+    if (directory[i].in_use && strcmp(directory[i].filename, filename) == 0){
+      return i;
     }
   }
-  // If the file was not found, print an error message and return
-  if (inode_index == -1) {
-    printf("Error: File not found.\n");
-    return;
+  return -1;
+}
+
+// Sparse files. An all-zero block of a file is not stored: its slot in the inode holds
+// HOLE_BLOCK instead of a data block and reads of it produce zeros. -1 still ends
+// the block list.
+#define HOLE_BLOCK -2
+
+int cpu_avx2 = 0; // the CPU has AVX2; set by cpuDetect before any thread starts
+
+void cpuDetect(){
+#if defined(__x86_64__) || defined(__i386__)
+  cpu_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+int blockIsZeroAVX2(const uint8_t * block){
+  __m256i acc = _mm256_setzero_si256();
+  for (int i = 0; i < BLOCK_SIZE; i += 128) {
+    __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (block + i)),
+                                _mm256_loadu_si256((const __m256i *) (block + i + 32)));
+    __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (block + i + 64)),
+                                _mm256_loadu_si256((const __m256i *) (block + i + 96)));
+    acc = _mm256_or_si256(acc, _mm256_or_si256(a, b));
   }
+  return _mm256_testz_si256(acc, acc);
+}
 
-  // Create a new filename if one is not provided
-  if (newfilename == NULL) {
-    newfilename = filename;
+__attribute__((target("sse2")))
+int blockIsZeroSSE2(const uint8_t * block){
+  __m128i acc = _mm_setzero_si128();
+  for (int i = 0; i < BLOCK_SIZE; i += 64) {
+    __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *) (block + i)),
+                             _mm_loadu_si128((const __m128i *) (block + i + 16)));
+    __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *) (block + i + 32)),
+                             _mm_loadu_si128((const __m128i *) (block + i + 48)));
+    acc = _mm_or_si128(acc, _mm_or_si128(a, b));
   }
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xFFFF;
+}
+#endif
 
-  // Open the output file for writing
-  FILE * ofp = fopen(newfilename, "w");
-  if (ofp == NULL) {
-    printf("Error: Could not open output file: %s\n", newfilename);
-    perror("Opening output file returned");
+// Whether a block holds only zero bytes. Uses AVX2 or SSE2 when the CPU has them.
+int blockIsZero(const uint8_t * block){
+#if defined(__x86_64__) || defined(__i386__)
+  if (cpu_avx2) {
+    return blockIsZeroAVX2(block);
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return blockIsZeroSSE2(block);
+  }
+#endif
+  uint64_t acc = 0;
+  for (int i = 0; i < BLOCK_SIZE; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, block + i, sizeof(word));
+    acc |= word;
+  }
+  return acc == 0;
+}
+
+// Inline files. A file of at most INLINE_MAX_SIZE bytes keeps its bytes in the space
+// of its inode's blocks[] array and has INLINE set in its attribute. It takes no data
+// blocks, and reading it touches only the inode table. The bytes past file_size are
+// kept zero, so growing the file within the inode needs no clearing.
+#define INLINE_MAX_SIZE (BLOCKS_PER_FILE * sizeof(int32_t))
+
+uint8_t * inlineData(int32_t inode_index){
+  return (uint8_t *) inodes[inode_index].blocks;
+}
+
+// Turn the all-zero data blocks of a freshly written file into holes.
+void punchZeroBlocks(int32_t inode_index){
+  if (inodes[inode_index].attribute & INLINE) {
     return;
   }
+  for (int b = 0; b < BLOCKS_PER_FILE && inodes[inode_index].blocks[b] != -1; b++) {
+    int32_t block_index = inodes[inode_index].blocks[b];
+    if (block_index != HOLE_BLOCK && blockIsZero(data[block_index])) {
+      free_blocks[block_index - FIRST_DATA_BLOCK] = 1;
+      inodes[inode_index].blocks[b] = HOLE_BLOCK;
+    }
+  }
+}
 
-  // Copy the file data to the output file using code from block_copy.c
-  int32_t copy_size   = buf . st_size;
-  int32_t block_index = 0;
-  int32_t offset = 0;
-  printf("Writing %d bytes to %s\n", (int) buf . st_size, newfilename);
-  while (copy_size > 0) {
-    int32_t num_bytes;
-    // If the remaining data is less than a full block, only copy that much
-    if (copy_size < BLOCK_SIZE) {
-      num_bytes = copy_size;
-    } else {
-      num_bytes = BLOCK_SIZE;
+// Data blocks, not counting holes, allocated to a file.
+int32_t allocatedBlocks(struct inode * node){
+  int32_t count = 0;
+  if (node->attribute & INLINE) {
+    return 0;
+  }
+  for (int b = 0; b < BLOCKS_PER_FILE && node->blocks[b] != -1; b++) {
+    if (node->blocks[b] != HOLE_BLOCK) {
+      count++;
     }
-    // Write the data to the output file and update the variables for the next block
-    fwrite(data[block_index], num_bytes, 1, ofp ); 
-    copy_size -= BLOCK_SIZE;
-    offset += BLOCK_SIZE;
-    block_index++;
-    fseek(ofp, offset, SEEK_SET);
   }
+  return count;
+}
+
+// At-rest encryption. A file with ENCRYPTED set is stored encrypted with ChaCha20
+// under its own key, derived with HChaCha20 from the key loaded with the key command
+// and the random salt in the file's directory entry. Block b of a file uses nonce b
+// and block counters 0-15, which cover its BLOCK_SIZE bytes exactly, so any block can
+// be read or rewritten on its own. Whole blocks are encrypted, the bytes past
+// file_size included, so a file can grow within its last block; holes stay
+// unencrypted zeros. There is no MAC: with the wrong key a file reads as garbage.
+#define CHACHA_BLOCKS (BLOCK_SIZE / 64) // 64-byte ChaCha blocks per file block
+
+struct _cipher {
+  uint32_t key[8];
+};
+
+struct _cipher master_key; // the key loaded with the key command
+int master_key_loaded = 0;
+
+#define CHACHA_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define CHACHA_QR(a, b, c, d) \
+  a += b; d ^= a; d = CHACHA_ROTL(d, 16); \
+  c += d; b ^= c; b = CHACHA_ROTL(b, 12); \
+  a += b; d ^= a; d = CHACHA_ROTL(d, 8); \
+  c += d; b ^= c; b = CHACHA_ROTL(b, 7);
+
+// The 20 rounds of ChaCha, without the final addition of the input.
+void chachaRounds(uint32_t x[16]){
+  for (int i = 0; i < 10; i++) {
+    CHACHA_QR(x[0], x[4], x[8], x[12]);
+    CHACHA_QR(x[1], x[5], x[9], x[13]);
+    CHACHA_QR(x[2], x[6], x[10], x[14]);
+    CHACHA_QR(x[3], x[7], x[11], x[15]);
+    CHACHA_QR(x[0], x[5], x[10], x[15]);
+    CHACHA_QR(x[1], x[6], x[11], x[12]);
+    CHACHA_QR(x[2], x[7], x[8], x[13]);
+    CHACHA_QR(x[3], x[4], x[9], x[14]);
+  }
+}
 
-  // Close the output file and print a success message
-  fclose(ofp);
+void chachaState(uint32_t state[16], const struct _cipher * cipher, uint32_t counter, uint32_t nonce){
+  state[0] = 0x61707865;
+  state[1] = 0x3320646e;
+  state[2] = 0x79622d32;
+  state[3] = 0x6b206574;
+  memcpy(state + 4, cipher->key, sizeof(cipher->key));
+  state[12] = counter;
+  state[13] = nonce;
+  state[14] = 0;
+  state[15] = 0;
 }
 
-// Print <number of bytes> bytes from the file, in hexadecimal, starting at <starting byte>
-void readfs(char * filename, int starting, int num_bytes) {
-  int32_t inode_index = -1;
-  int32_t current = 0;
-  int32_t offset = 0;
-  
-  // Find the inode index of the file
-  for (int i = 0; i < NUM_FILES; i++){
-    if(strcmp(directory[i].filename, filename) == 0){
-    inode_index = directory[i].inode;
-    break;
+// XOR a file block with its keystream, one ChaCha block at a time.
+void chachaBlockScalar(const struct _cipher * cipher, uint32_t nonce, uint8_t * buf){
+  for (int j = 0; j < CHACHA_BLOCKS; j++) {
+    uint32_t state[16];
+    uint32_t x[16];
+    chachaState(state, cipher, j, nonce);
+    memcpy(x, state, sizeof(x));
+    chachaRounds(x);
+    for (int i = 0; i < 16; i++) {
+      uint32_t word = x[i] + state[i];
+      for (int k = 0; k < 4; k++) {
+        buf[64 * j + 4 * i + k] ^= (uint8_t) (word >> (8 * k));
+      }
     }
   }
-  if(inode_index == -1){
-    perror("Failed to find free inode\n");
-    return;
-  }
-  
-  // Read data block by block
-  uint8_t* file_data = (uint8_t*) malloc(num_bytes);
-  for (int i = 0; i< NUM_BLOCKS; i++){
-    // Exit the loop if we've read all the blocks
-    if (current == BLOCKS_PER_FILE){
-      break;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// The SIMD versions run one ChaCha block per vector lane, 4 with SSE2 and 8 with AVX2,
+// and transpose the lanes back into consecutive 64-byte blocks before the XOR.
+#define CHACHA_ROTL_SSE2(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+#define CHACHA_QR_SSE2(a, b, c, d) \
+  a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = CHACHA_ROTL_SSE2(d, 16); \
+  c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = CHACHA_ROTL_SSE2(b, 12); \
+  a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = CHACHA_ROTL_SSE2(d, 8); \
+  c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = CHACHA_ROTL_SSE2(b, 7);
+
+__attribute__((target("sse2")))
+void chachaBlockSSE2(const struct _cipher * cipher, uint32_t nonce, uint8_t * buf){
+  uint32_t state[16];
+  chachaState(state, cipher, 0, nonce);
+  for (int j = 0; j < CHACHA_BLOCKS; j += 4) {
+    __m128i s[16];
+    __m128i x[16];
+    for (int i = 0; i < 16; i++) {
+      s[i] = _mm_set1_epi32(state[i]);
     }
-    // Exit the loop if we've reached an invalid block
-    if (inodes[inode_index].blocks[current] == -1){
-      break;
+    s[12] = _mm_set_epi32(j + 3, j + 2, j + 1, j);
+    for (int i = 0; i < 16; i++) {
+      x[i] = s[i];
+    }
+    for (int r = 0; r < 10; r++) {
+      CHACHA_QR_SSE2(x[0], x[4], x[8], x[12]);
+      CHACHA_QR_SSE2(x[1], x[5], x[9], x[13]);
+      CHACHA_QR_SSE2(x[2], x[6], x[10], x[14]);
+      CHACHA_QR_SSE2(x[3], x[7], x[11], x[15]);
+      CHACHA_QR_SSE2(x[0], x[5], x[10], x[15]);
+      CHACHA_QR_SSE2(x[1], x[6], x[11], x[12]);
+      CHACHA_QR_SSE2(x[2], x[7], x[8], x[13]);
+      CHACHA_QR_SSE2(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++) {
+      x[i] = _mm_add_epi32(x[i], s[i]);
+    }
+    // words 4q-4q+3 of the four blocks
+    for (int q = 0; q < 4; q++) {
+      __m128i t0 = _mm_unpacklo_epi32(x[4 * q], x[4 * q + 1]);
+      __m128i t1 = _mm_unpackhi_epi32(x[4 * q], x[4 * q + 1]);
+      __m128i t2 = _mm_unpacklo_epi32(x[4 * q + 2], x[4 * q + 3]);
+      __m128i t3 = _mm_unpackhi_epi32(x[4 * q + 2], x[4 * q + 3]);
+      __m128i y[4] = { _mm_unpacklo_epi64(t0, t2), _mm_unpackhi_epi64(t0, t2),
+                       _mm_unpacklo_epi64(t1, t3), _mm_unpackhi_epi64(t1, t3) };
+      for (int k = 0; k < 4; k++) {
+        __m128i * p = (__m128i *) (buf + 64 * (j + k) + 16 * q);
+        _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), y[k]));
+      }
     }
-    // Copy the block's data into the file_data buffer
-    memcpy(file_data + offset, data[inodes[inode_index].blocks[current]], BLOCK_SIZE);
-    current++;
-    offset += BLOCK_SIZE;
-  }
-  
-  // Print the file data starting at the specified byte offset
-  for (int i = starting; i < starting + num_bytes; i++) {
-    printf("%02x ", file_data[i]);
   }
-  printf("\n");
-  
-  // Free the memory allocated for the file data buffer
-  free(file_data);
 }
 
-void deletefs (char * filename) {
-  int file_found = 0;
-  int32_t inode_index = -1;
-  int32_t block_index = -1;
+#define CHACHA_ROTL_AVX2(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+#define CHACHA_QR_AVX2(a, b, c, d) \
+  a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = CHACHA_ROTL_AVX2(d, 16); \
+  c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = CHACHA_ROTL_AVX2(b, 12); \
+  a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = CHACHA_ROTL_AVX2(d, 8); \
+  c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = CHACHA_ROTL_AVX2(b, 7);
 
-  // finding inode of that filename
-  for (int i =- 0; i < NUM_FILES; i++){
-    if(directory[i].in_use && strcmp(directory[i].filename, filename) == 0){
-      inode_index = directory[i].inode;
-      directory[i].in_use = 0;
-      directory[i].inode = -1;
-      memset(directory[i].filename,0,64);
-      file_found = 1;
-      break;
+__attribute__((target("avx2")))
+void chachaBlockAVX2(const struct _cipher * cipher, uint32_t nonce, uint8_t * buf){
+  uint32_t state[16];
+  chachaState(state, cipher, 0, nonce);
+  for (int j = 0; j < CHACHA_BLOCKS; j += 8) {
+    __m256i s[16];
+    __m256i x[16];
+    for (int i = 0; i < 16; i++) {
+      s[i] = _mm256_set1_epi32(state[i]);
+    }
+    s[12] = _mm256_set_epi32(j + 7, j + 6, j + 5, j + 4, j + 3, j + 2, j + 1, j);
+    for (int i = 0; i < 16; i++) {
+      x[i] = s[i];
+    }
+    for (int r = 0; r < 10; r++) {
+      CHACHA_QR_AVX2(x[0], x[4], x[8], x[12]);
+      CHACHA_QR_AVX2(x[1], x[5], x[9], x[13]);
+      CHACHA_QR_AVX2(x[2], x[6], x[10], x[14]);
+      CHACHA_QR_AVX2(x[3], x[7], x[11], x[15]);
+      CHACHA_QR_AVX2(x[0], x[5], x[10], x[15]);
+      CHACHA_QR_AVX2(x[1], x[6], x[11], x[12]);
+      CHACHA_QR_AVX2(x[2], x[7], x[8], x[13]);
+      CHACHA_QR_AVX2(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++) {
+      x[i] = _mm256_add_epi32(x[i], s[i]);
+    }
+    // the unpacks work within 128-bit halves: the low half ends up with blocks j to
+    // j+3 and the high half with blocks j+4 to j+7
+    for (int q = 0; q < 4; q++) {
+      __m256i t0 = _mm256_unpacklo_epi32(x[4 * q], x[4 * q + 1]);
+      __m256i t1 = _mm256_unpackhi_epi32(x[4 * q], x[4 * q + 1]);
+      __m256i t2 = _mm256_unpacklo_epi32(x[4 * q + 2], x[4 * q + 3]);
+      __m256i t3 = _mm256_unpackhi_epi32(x[4 * q + 2], x[4 * q + 3]);
+      __m256i y[4] = { _mm256_unpacklo_epi64(t0, t2), _mm256_unpackhi_epi64(t0, t2),
+                       _mm256_unpacklo_epi64(t1, t3), _mm256_unpackhi_epi64(t1, t3) };
+      for (int k = 0; k < 4; k++) {
+        __m128i * low = (__m128i *) (buf + 64 * (j + k) + 16 * q);
+        __m128i * high = (__m128i *) (buf + 64 * (j + k + 4) + 16 * q);
+        _mm_storeu_si128(low, _mm_xor_si128(_mm_loadu_si128(low), _mm256_castsi256_si128(y[k])));
+        _mm_storeu_si128(high, _mm_xor_si128(_mm_loadu_si128(high), _mm256_extracti128_si256(y[k], 1)));
+      }
     }
   }
-  if(!file_found){
-    printf("Error: file not found\n");
+}
+#endif
+
+// Encrypt or decrypt block nonce of a file in place. Uses AVX2 or SSE2 when the CPU
+// has them.
+void chachaBlock(const struct _cipher * cipher, uint32_t nonce, uint8_t * buf){
+#if defined(__x86_64__) || defined(__i386__)
+  if (cpu_avx2) {
+    chachaBlockAVX2(cipher, nonce, buf);
     return;
   }
-  // free all blocks used by file
-  for(int i = 0; i < BLOCKS_PER_FILE; i++){
-    block_index = inodes[inode_index].blocks[i];
-    if (block_index != -1){
-      free_blocks[block_index - FIRST_DATA_BLOCK] = 1;
-      inodes[inode_index].blocks[i] = -1;
-    }
+  if (__builtin_cpu_supports("sse2")) {
+    chachaBlockSSE2(cipher, nonce, buf);
+    return;
   }
-  // free that inode then update the variables
-  free_inodes[inode_index] = 1;
-  inodes[inode_index].in_use = 0;
-  inodes[inode_index].attribute = 0;
-  inodes[inode_index].file_size = 0;
-  printf("%s deleted!", filename);
+#endif
+  chachaBlockScalar(cipher, nonce, buf);
 }
 
-void undelfs (char * filename) {
-  int32_t inode_index = -1;
-  // searching for the inode index of the file in the directory
-  for (int i = 0; i < NUM_FILES; i++){
-    if(directory[i].in_use && strcmp(directory[i].filename, filename) == 0){
-      inode_index = directory[i].inode;
-      // marking the inode and directory entry as in use
-      directory[i].in_use = 1;
-      inodes[inode_index].in_use = 1;
-      printf("%s undeleted", filename);
-      return;
-    }  
+// The key of a file: HChaCha20 of the loaded key and the file's salt.
+void fileKey(int32_t directory_entry, struct _cipher * cipher){
+  uint32_t x[16];
+  uint32_t salt[4];
+  memcpy(salt, directory[directory_entry].salt, sizeof(salt));
+  chachaState(x, &master_key, salt[0], salt[1]);
+  x[14] = salt[2];
+  x[15] = salt[3];
+  chachaRounds(x);
+  memcpy(cipher->key, x, 4 * sizeof(uint32_t));
+  memcpy(cipher->key + 4, x + 12, 4 * sizeof(uint32_t));
+}
+
+// Draw a fresh random salt into salt. Returns 0, or -1 when the kernel has no
+// randomness to give: an old salt must never stand in for a fresh one.
+int randomSalt(uint8_t salt[16]){
+  if (getrandom(salt, 16, 0) != 16) {
+    printf("encrypt: No random salt: %s\n", strerror(errno));
+    return -1;
   }
-  // if file not found
-  printf("Can not find the file.\n");
+  return 0;
 }
 
-void listfs () {
-  int not_found = 1;
-  for (int i = 0; i < NUM_FILES; i++){
-    // todo hidden files
-    // check if the file is hidden and whether to show it
-    // if yes, list it also
-    if (!show_hidden && directory[i].filename[0] == '.') {
-      printf("%s\n", directory[i].filename);
+// Give a file a fresh random salt, and so a key of its own. Returns 0, or -1 with the
+// salt the file had.
+int fileSalt(int32_t directory_entry){
+  uint8_t salt[16];
+  if (randomSalt(salt) == -1) {
+    return -1;
+  }
+  memcpy(directory[directory_entry].salt, salt, sizeof(salt));
+  return 0;
+}
+
+// The cipher for a file. Returns NULL for a plaintext file, cipher filled in with the
+// file's key for an encrypted one, or NULL with *missing set when the file is
+// encrypted and no key is loaded.
+struct _cipher * fileCipher(int32_t directory_entry, struct _cipher * cipher, int * missing){
+  *missing = 0;
+  if (!(inodes[directory[directory_entry].inode].attribute & ENCRYPTED)) {
+    return NULL;
+  }
+  if (!master_key_loaded) {
+    *missing = 1;
+    return NULL;
+  }
+  fileKey(directory_entry, cipher);
+  return cipher;
+}
+
+// I/O engine. Block transfers between the image and host files are queued on an
+// engine and completed by ioDrain. The sync engine is the plain pread/pwrite path: it
+// merges queued requests for neighbouring offsets into one preadv/pwritev call. The
+// io_uring engine keeps up to depth requests in flight and uses READ_FIXED/WRITE_FIXED
+// on a buffer registered over the image, so the kernel does not map the pages on every
+// request. When io_uring cannot be set up the sync engine is used instead.
+#define IO_SYNC 0
+#define IO_URING 1
+#define IO_MAX_DEPTH 256
+#define IO_DEFAULT_DEPTH 32
+#define IO_CHUNK_BLOCKS 64 // blocks per request when moving the whole image
+#define IO_READ 0
+#define IO_WRITE 1
+
+struct _ioRequest {
+  int op;
+  int fd;
+  uint8_t * buf;
+  uint32_t len;
+  off_t offset;
+};
+
+struct _ioEngine {
+  int kind;
+  int depth;
+  long bytes;   // transferred since the last drain
+  int errors;   // failed requests since the last drain
+  // sync: requests waiting to be merged; io_uring: the request behind each slot
+  struct _ioRequest requests[IO_MAX_DEPTH];
+  int pending;
+  // io_uring state
+  int ring_fd;
+  int free_slots[IO_MAX_DEPTH];
+  int num_free;
+  unsigned unsubmitted;
+  unsigned * sq_head;
+  unsigned * sq_tail;
+  unsigned * sq_mask;
+  unsigned * sq_array;
+  unsigned * cq_head;
+  unsigned * cq_tail;
+  unsigned * cq_mask;
+  struct io_uring_sqe * sqes;
+  struct io_uring_cqe * cqes;
+  void * sq_ring;
+  void * cq_ring;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  uint8_t * registered; // start of the registered buffer, NULL if none
+  size_t registered_len;
+};
+
+struct _ioEngine io_engine; // engine used by the command thread
+int io_engine_ready = 0;
+int io_engine_kind = IO_URING;
+int io_engine_depth = IO_DEFAULT_DEPTH;
+
+int uringSetup(struct _ioEngine * engine){
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  engine->ring_fd = syscall(__NR_io_uring_setup, engine->depth, &params);
+  if (engine->ring_fd < 0) {
+    return -1;
+  }
+  engine->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  engine->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (engine->cq_ring_size > engine->sq_ring_size) {
+      engine->sq_ring_size = engine->cq_ring_size;
     }
-    // if -a parameter is provided, list the attribute as well
-    if (show_attributes) {
-      printf("%s - %d\n", directory[i].filename, inodes[i].attribute);
-    }  
-    //For each file, if it is in use, the function stores its name in a temporary buffer "filename".  
-    if (directory[i].in_use) {
-      not_found = 0;
-      char filename[64];
-      memset (filename,0,65);
-      strncpy(filename,directory[i].filename,strlen(directory[i].filename));
+    engine->cq_ring_size = engine->sq_ring_size;
+  }
+  engine->sq_ring = mmap(NULL, engine->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         engine->ring_fd, IORING_OFF_SQ_RING);
+  if (engine->sq_ring == MAP_FAILED) {
+    close(engine->ring_fd);
+    return -1;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    engine->cq_ring = engine->sq_ring;
+  }
+  else {
+    engine->cq_ring = mmap(NULL, engine->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           engine->ring_fd, IORING_OFF_CQ_RING);
+    if (engine->cq_ring == MAP_FAILED) {
+      munmap(engine->sq_ring, engine->sq_ring_size);
+      close(engine->ring_fd);
+      return -1;
     }
   }
-  if (not_found){
-    perror("No files found");
+  engine->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  engine->sqes = mmap(NULL, engine->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      engine->ring_fd, IORING_OFF_SQES);
+  if (engine->sqes == MAP_FAILED) {
+    if (engine->cq_ring != engine->sq_ring) {
+      munmap(engine->cq_ring, engine->cq_ring_size);
+    }
+    munmap(engine->sq_ring, engine->sq_ring_size);
+    close(engine->ring_fd);
+    return -1;
+  }
+  uint8_t * sq = (uint8_t *) engine->sq_ring;
+  uint8_t * cq = (uint8_t *) engine->cq_ring;
+  engine->sq_head = (unsigned *) (sq + params.sq_off.head);
+  engine->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  engine->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+  engine->sq_array = (unsigned *) (sq + params.sq_off.array);
+  engine->cq_head = (unsigned *) (cq + params.cq_off.head);
+  engine->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  engine->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+  engine->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+  return 0;
+}
+
+// Register buf as fixed buffer 0 of the ring. Requests inside it then use the
+// _FIXED opcodes. Failing to register (e.g. RLIMIT_MEMLOCK) is not an error.
+void uringRegister(struct _ioEngine * engine, uint8_t * buf, size_t len){
+  if (engine->kind != IO_URING || engine->registered == buf) {
     return;
   }
+  if (engine->registered != NULL) {
+    syscall(__NR_io_uring_register, engine->ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    engine->registered = NULL;
+  }
+  struct iovec iov = { buf, len };
+  if (syscall(__NR_io_uring_register, engine->ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0) {
+    engine->registered = buf;
+    engine->registered_len = len;
+  }
 }
 
-int dffs() {
-  int count = 0;
-  // Count the total amount of free space in the filesystem 
-  //by counting the number of free blocks and multiplying it by the block size.
-  for (int i = 0; i < NUM_BLOCKS; i++){
-    if (free_blocks[i]){
-      count++;
+int ioEngineInit(struct _ioEngine * engine, int kind, int depth){
+  memset(engine, 0, sizeof(struct _ioEngine));
+  engine->depth = depth < 1 ? 1 : (depth > IO_MAX_DEPTH ? IO_MAX_DEPTH : depth);
+  engine->kind = IO_SYNC;
+  engine->ring_fd = -1;
+  if (kind == IO_URING) {
+    if (uringSetup(engine) == -1) {
+      return -1;
     }
+    engine->kind = IO_URING;
+    for (int i = 0; i < engine->depth; i++) {
+      engine->free_slots[i] = engine->depth - 1 - i;
+    }
+    engine->num_free = engine->depth;
   }
-  return count * BLOCK_SIZE;  
+  return 0;
 }
 
-void insertfs (char * filename){
-  //check for NULL in filename
-  if (filename == NULL){
-    perror("Filename is NULL\n");
-    return;
-  }
-  //check if the file is exists
-  struct stat buf;
-  int ret = stat (filename, &buf);
-  if (ret == -1) {
-    perror("File is not exist\n");
-    return;
+// Set up an engine of the configured kind, falling back to sync.
+void ioEngineOpen(struct _ioEngine * engine){
+  if (ioEngineInit(engine, io_engine_kind, io_engine_depth) == -1) {
+    ioEngineInit(engine, IO_SYNC, io_engine_depth);
   }
-  //check if the file name too long
-  if (strlen(filename) > MAX_NAME_SIZE) {
-    perror("File name too long\n");
+}
+
+void ioEngineDestroy(struct _ioEngine * engine){
+  if (engine->kind != IO_URING) {
     return;
   }
-  //check if the file is too big
-  if(buf.st_size > MAX_FILE_SIZE){
-    perror("File is too big");
-    return;
+  munmap(engine->sqes, engine->sqes_size);
+  if (engine->cq_ring != engine->sq_ring) {
+    munmap(engine->cq_ring, engine->cq_ring_size);
   }
-  //check if there is enough disk space
-  if(buf.st_size > dffs()){
-    perror("Not enough disk space");
-    return;
+  munmap(engine->sq_ring, engine->sq_ring_size);
+  close(engine->ring_fd);
+  engine->kind = IO_SYNC;
+}
+
+// The command thread's engine, with the image registered as fixed buffer.
+struct _ioEngine * ioEngine(){
+  if (!io_engine_ready) {
+    ioEngineOpen(&io_engine);
+    io_engine_ready = 1;
   }
-  // find empty directory entry
-  else{
-    int directory_entry = -1;
-    for (int i = 0; i < NUM_FILES; i ++){
-      if(directory[i].in_use == 0){
-        directory_entry = i;
-        break;  
+  uringRegister(&io_engine, &data[0][0], (size_t) NUM_BLOCKS * BLOCK_SIZE);
+  return &io_engine;
+}
+
+// Run the merged sync requests: neighbouring requests of the same kind on the same
+// file become one vectored call.
+void syncFlush(struct _ioEngine * engine){
+  struct iovec iov[IO_MAX_DEPTH];
+  int i = 0;
+  while (i < engine->pending) {
+    struct _ioRequest * first = &engine->requests[i];
+    off_t end = first->offset;
+    int count = 0;
+    while (i + count < engine->pending) {
+      struct _ioRequest * request = &engine->requests[i + count];
+      if (request->op != first->op || request->fd != first->fd || request->offset != end) {
+        break;
       }
+      iov[count].iov_base = request->buf;
+      iov[count].iov_len = request->len;
+      end += request->len;
+      count++;
     }
-    if (directory_entry == -1) {
-      perror("Failed to find a free directory entry\n");
+    ssize_t bytes = first->op == IO_READ ? preadvFull(first->fd, iov, count, first->offset)
+                                         : pwritevFull(first->fd, iov, count, first->offset);
+    if (bytes < 0) {
+      engine->errors++;
+    }
+    else {
+      engine->bytes += bytes;
+    }
+    i += count;
+  }
+  engine->pending = 0;
+}
+
+void uringPrepare(struct _ioEngine * engine, int slot){
+  struct _ioRequest * request = &engine->requests[slot];
+  unsigned tail = *engine->sq_tail;
+  unsigned index = tail & *engine->sq_mask;
+  struct io_uring_sqe * sqe = &engine->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  int fixed = engine->registered != NULL && request->buf >= engine->registered &&
+              request->buf + request->len <= engine->registered + engine->registered_len;
+  if (request->op == IO_READ) {
+    sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  }
+  else {
+    sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+  }
+  sqe->fd = request->fd;
+  sqe->addr = (uint64_t) (uintptr_t) request->buf;
+  sqe->len = request->len;
+  sqe->off = request->offset;
+  sqe->buf_index = 0;
+  sqe->user_data = slot;
+  engine->sq_array[index] = index;
+  __atomic_store_n(engine->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  engine->unsubmitted++;
+}
+
+// Submit what is queued and wait for at least min_complete completions, handling each.
+void uringReap(struct _ioEngine * engine, unsigned min_complete){
+  while (1) {
+    int ret = syscall(__NR_io_uring_enter, engine->ring_fd, engine->unsubmitted, min_complete,
+                      min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (ret >= 0) {
+      engine->unsubmitted -= (unsigned) ret < engine->unsubmitted ? (unsigned) ret : engine->unsubmitted;
+      break;
+    }
+    if (errno != EINTR) {
+      // the ring is unusable; fail what is outstanding and carry on with sync I/O
+      engine->errors += engine->depth - engine->num_free;
+      engine->num_free = 0;
+      for (int i = 0; i < engine->depth; i++) {
+        engine->free_slots[engine->num_free++] = i;
+      }
+      engine->unsubmitted = 0;
+      engine->registered = NULL;
+      ioEngineDestroy(engine);
+      engine->pending = 0;
       return;
     }
-    FILE *ifp = fopen (filename, "r" ); 
-    printf("Reading %d bytes from %s\n", (int) buf . st_size, filename);
-    // Save off the size of the input file since we'll use it in a couple of places and 
-    // also initialize our index variables to zero. 
-    int copy_size   = buf . st_size;
-    // We want to copy and write in chunks of BLOCK_SIZE. So to do this 
-    // we are going to use fseek to move along our file stream in chunks of BLOCK_SIZE.
-    // We will copy bytes, increment our file pointer by BLOCK_SIZE and repeat.
-    int offset      = 0;     
-    // We are going to copy and store our file in BLOCK_SIZE chunks instead of one big 
-    // memory pool. Why? We are simulating the way the file system stores file data in
-    // blocks of space on the disk. block_index will keep us pointing to the area of
-    // the area that we will read from or write to.          
-    int block_index = -1;
-    //find a free inode
-    int32_t inode_index = findFreeInode();
-    if(inode_index == -1){
-      perror("Failed to find free inode\n");
-      return;
+  }
+  unsigned head = *engine->cq_head;
+  while (head != __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe * cqe = &engine->cqes[head & *engine->cq_mask];
+    int slot = (int) cqe->user_data;
+    struct _ioRequest * request = &engine->requests[slot];
+    int res = cqe->res;
+    head++;
+    if (res == -EINTR || res == -EAGAIN) {
+      uringPrepare(engine, slot);
+      continue;
     }
-    //place the file in the directory
-    directory[directory_entry].in_use = 1;
-    directory[directory_entry].inode = inode_index;
-    strncpy(directory[directory_entry].filename,filename, strlen(filename));
-    inodes[inode_index].file_size = buf.st_size;
-    // copy_size is initialized to the size of the input file so each loop iteration we
-    // will copy BLOCK_SIZE bytes from the file then reduce our copy_size counter by
-    // BLOCK_SIZE number of bytes. When copy_size is less than or equal to zero we know
-    // we have copied all the data from the input file.
-    while( copy_size > 0 ){
-      // Index into the input file by offset number of bytes.  Initially offset is set to
-      // zero so we copy BLOCK_SIZE number of bytes from the front of the file.  We 
-      // then increase the offset by BLOCK_SIZE and continue the process.  This will
-      // make us copy from offsets 0, BLOCK_SIZE, 2*BLOCK_SIZE, 3*BLOCK_SIZE, etc.
-      fseek( ifp, offset, SEEK_SET );
-      //find a free_blocks
-      block_index = findFreeBlock();
-      if (block_index == -1){
-        perror("Failed to find free block\n");
-        return;
+    if (res < 0) {
+      engine->errors++;
+    }
+    else {
+      engine->bytes += res;
+      // a short transfer before end of file is resubmitted for the rest
+      if (res > 0 && (uint32_t) res < request->len) {
+        request->buf += res;
+        request->len -= res;
+        request->offset += res;
+        uringPrepare(engine, slot);
+        continue;
       }
-      // Read BLOCK_SIZE number of bytes from the input file and store them in our
-      // data array. 
-      int32_t bytes  = fread(data[block_index], BLOCK_SIZE, 1, ifp );
-      // save the block in the inode
-      int32_t inode_block = findFreeInodeBlock(inode_index);
-      inodes[inode_index].blocks[inode_block] = block_index;
-      // If bytes == 0 and we haven't reached the end of the file then something is 
-      // wrong. If 0 is returned and we also have the EOF flag set then that is OK.
-      // It means we've reached the end of our input file.
-      if( bytes == 0 && !feof( ifp ) ){
-        perror("An error occured reading from the input file.\n");
-        return;
+    }
+    engine->free_slots[engine->num_free++] = slot;
+  }
+  __atomic_store_n(engine->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Queue one transfer. buf must stay valid until the next ioDrain.
+void ioQueue(struct _ioEngine * engine, int op, int fd, uint8_t * buf, uint32_t len, off_t offset){
+  while (engine->kind == IO_URING && engine->num_free == 0) {
+    uringReap(engine, 1);
+  }
+  if (engine->kind == IO_SYNC) {
+    if (engine->pending == engine->depth || engine->pending == IO_MAX_DEPTH) {
+      syncFlush(engine);
+    }
+    struct _ioRequest * request = &engine->requests[engine->pending++];
+    request->op = op;
+    request->fd = fd;
+    request->buf = buf;
+    request->len = len;
+    request->offset = offset;
+    return;
+  }
+  int slot = engine->free_slots[--engine->num_free];
+  struct _ioRequest * request = &engine->requests[slot];
+  request->op = op;
+  request->fd = fd;
+  request->buf = buf;
+  request->len = len;
+  request->offset = offset;
+  uringPrepare(engine, slot);
+}
+
+// Wait for every queued transfer. Returns the bytes moved since the last drain or -1
+// if any request failed.
+long ioDrain(struct _ioEngine * engine){
+  if (engine->kind == IO_SYNC) {
+    syncFlush(engine);
+  }
+  else {
+    while (engine->kind == IO_URING && engine->num_free < engine->depth) {
+      uringReap(engine, 1);
+    }
+  }
+  long bytes = engine->errors ? -1 : engine->bytes;
+  engine->bytes = 0;
+  engine->errors = 0;
+  return bytes;
+}
+
+// Queue the writes of blocks [first, first + count) of a file to fd at their offsets
+// within the file. The last block of the file is cut at file_size. The caller sizes
+// fd to file_size first so that holes, which are not written, read back as zeros.
+// An encrypted file is decrypted into a buffer that must outlive the writes, so its
+// writes are completed here. Returns -1, with errno set, if they failed or there was
+// no memory for the buffer.
+long writeFileBlocks(struct _ioEngine * engine, int fd, int32_t inode_index, int32_t first, int32_t count,
+                     const struct _cipher * cipher){
+  int64_t remaining = (int64_t) inodes[inode_index].file_size - (int64_t) first * BLOCK_SIZE;
+  if (cipher != NULL) {
+    uint8_t * plain = (uint8_t *) malloc((size_t) count * BLOCK_SIZE);
+    if (plain == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    for (int32_t b = first; b < first + count && remaining > 0; b++) {
+      uint32_t len = remaining < BLOCK_SIZE ? remaining : BLOCK_SIZE;
+      uint8_t * block = plain + (size_t) (b - first) * BLOCK_SIZE;
+      if (inodes[inode_index].attribute & INLINE) {
+        memcpy(block, inlineData(inode_index) + (size_t) b * BLOCK_SIZE, BLOCK_SIZE);
       }
-      // Clear the EOF file flag.
-      clearerr( ifp );
-      // Reduce copy_size by the BLOCK_SIZE bytes.
-      copy_size -= BLOCK_SIZE;
-      // Increase the offset into our input file by BLOCK_SIZE.  This will allow
-      // the fseek at the top of the loop to position us to the correct spot.
-      offset    += BLOCK_SIZE;
-      // Increment the index into the block array 
-      // DO NOT just increment block index in your file system
-      block_index = findFreeBlock();
+      else if (inodes[inode_index].blocks[b] != HOLE_BLOCK) {
+        memcpy(block, data[inodes[inode_index].blocks[b]], BLOCK_SIZE);
+      }
+      else {
+        remaining -= len;
+        continue;
+      }
+      chachaBlock(cipher, b, block);
+      ioQueue(engine, IO_WRITE, fd, block, len, (off_t) b * BLOCK_SIZE);
+      remaining -= len;
     }
-    // We are done copying from the input file so close it out.
-    fclose( ifp );
+    long result = ioDrain(engine);
+    free(plain);
+    return result == -1 ? -1 : 0;
+  }
+  if (inodes[inode_index].attribute & INLINE) {
+    int64_t len = (int64_t) count * BLOCK_SIZE < remaining ? (int64_t) count * BLOCK_SIZE : remaining;
+    if (len > 0) {
+      ioQueue(engine, IO_WRITE, fd, inlineData(inode_index) + (size_t) first * BLOCK_SIZE, len,
+              (off_t) first * BLOCK_SIZE);
+    }
+    return 0;
   }
+  for (int32_t b = first; b < first + count && remaining > 0; b++) {
+    uint32_t len = remaining < BLOCK_SIZE ? remaining : BLOCK_SIZE;
+    // holes are skipped, leaving a hole in the output file as well
+    if (inodes[inode_index].blocks[b] != HOLE_BLOCK) {
+      ioQueue(engine, IO_WRITE, fd, data[inodes[inode_index].blocks[b]], len, (off_t) b * BLOCK_SIZE);
+    }
+    remaining -= len;
+  }
+  return 0;
 }
 
+// Copy len bytes starting at offset within the file into buf, decrypting them with
+// cipher unless it is NULL.
+void readFileData(int32_t inode_index, uint32_t offset, uint8_t * buf, uint32_t len, const struct _cipher * cipher){
+  if ((inodes[inode_index].attribute & INLINE) && cipher == NULL) {
+    memcpy(buf, inlineData(inode_index) + offset, len);
+    return;
+  }
+  while (len > 0) {
+    uint32_t within = offset % BLOCK_SIZE;
+    uint32_t chunk = BLOCK_SIZE - within < len ? BLOCK_SIZE - within : len;
+    uint8_t * block = NULL;
+    if (inodes[inode_index].attribute & INLINE) {
+      block = inlineData(inode_index) + (offset - within);
+    }
+    else if (inodes[inode_index].blocks[offset / BLOCK_SIZE] != HOLE_BLOCK) {
+      block = data[inodes[inode_index].blocks[offset / BLOCK_SIZE]];
+    }
+    if (block == NULL) {
+      memset(buf, 0, chunk);
+    }
+    else if (cipher != NULL) {
+      // decrypt the whole block, then take the part that was asked for
+      uint8_t plain[BLOCK_SIZE];
+      memcpy(plain, block, BLOCK_SIZE);
+      chachaBlock(cipher, offset / BLOCK_SIZE, plain);
+      memcpy(buf, plain + within, chunk);
+    }
+    else {
+      memcpy(buf, block + within, chunk);
+    }
+    buf += chunk;
+    offset += chunk;
+    len -= chunk;
+  }
+}
 
-void openfs(char * filename){
-  // reads the contents of the file into system blocks
-  file = fopen(filename, "r");
-  strncpy(image_name,filename, strlen(filename));
-  fread(&data[0][0],BLOCK_SIZE,NUM_BLOCKS,file);
-  // set to 1 to indicate that the filesystem image has been opened
-  image_open = 1;
-  fclose(file);
+int32_t fileBlockCount(int32_t inode_index){
+  return (inodes[inode_index].file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
 }
 
-void closefs() {
-  if (image_open == 0){
-    perror("Disk image is not open\n");
-    return; 
+// Block generations. block_gen records the generation in which each block last
+// changed. Data blocks are stamped with touchBlock where they are written; metadata
+// blocks (everything before FIRST_DATA_BLOCK) are stamped by commitGeneration, which
+// compares them with a shadow copy after every command. A command that changed any
+// block closes the generation. delta-export uses the stamps to send only what changed.
+uint32_t block_gen[NUM_BLOCKS];
+uint32_t generation = 1;   // last closed generation
+int generation_dirty = 0;  // blocks were stamped generation + 1 since it closed
+uint8_t metadata_shadow[FIRST_DATA_BLOCK][BLOCK_SIZE];
+
+// Blocks changed since the image file was last written, for autosave.
+uint8_t block_dirty[NUM_BLOCKS];
+int32_t dirty_blocks = 0;
+uint8_t saved_free[NUM_DATA_BLOCKS]; // free_blocks as the image file was last written
+
+void markDirty(int32_t block_index){
+  if (!block_dirty[block_index]) {
+    block_dirty[block_index] = 1;
+    dirty_blocks++;
   }
-  fclose(file);
-  // set to 0 to indicate that the filesystem image has been opened
-  // 0 initialize image_name to 
-  image_open = 0;
-  memset(image_name,0,64);  
 }
 
-// create new file system on disk
-// initialize superblock then allocate inodes and data blocks
-// after that, create the root directory and set its metadata
-// finally, write the file system to disk
-void createfs (char * filename){
-  file = fopen(filename, "w");
-  strncpy(image_name,filename, strlen(filename));
-  memset(data,0,NUM_BLOCKS * BLOCK_SIZE);
-  image_open = 1;
+void markClean(){
+  memset(block_dirty, 0, sizeof(block_dirty));
+  dirty_blocks = 0;
+  memcpy(saved_free, free_blocks, NUM_DATA_BLOCKS);
+}
+
+void touchBlock(int32_t block_index){
+  block_gen[block_index] = generation + 1;
+  generation_dirty = 1;
+  markDirty(block_index);
+}
+
+void commitGeneration(){
+  for (int b = 0; b < FIRST_DATA_BLOCK; b++) {
+    if (memcmp(metadata_shadow[b], data[b], BLOCK_SIZE) != 0) {
+      memcpy(metadata_shadow[b], data[b], BLOCK_SIZE);
+      touchBlock(b);
+    }
+  }
+  if (generation_dirty) {
+    generation++;
+    generation_dirty = 0;
+  }
+}
+
+// Forget pending changes: the image as it is now is generation's state.
+void resetGeneration(){
+  memcpy(metadata_shadow, &data[0][0], sizeof(metadata_shadow));
+  generation_dirty = 0;
+}
+
+// Snapshot block references. block_refs[b] counts the snapshots whose inode tables
+// point at data block FIRST_DATA_BLOCK + b. Such a block stays allocated after the
+// live file system lets go of it and must be copied before it is written in place.
+#define MAX_SNAPSHOTS 16
+#define METADATA_BLOCKS FREE_BLOCK_MAP // directory, free inode map and inode table
+
+uint16_t block_refs[NUM_DATA_BLOCKS];
+
+// Give a data block back to the free map unless a snapshot still holds it.
+void releaseBlock(int32_t block_index){
+  if (block_refs[block_index - FIRST_DATA_BLOCK] == 0) {
+    free_blocks[block_index - FIRST_DATA_BLOCK] = 1;
+  }
+}
+
+// Make block index of a live file safe to modify in place. A block shared with a
+// snapshot is copied, and a hole is filled with zeros, in a fresh block which replaces
+// it in the inode. Returns the
+// block to write to, or -1 when the image is full.
+int32_t cowBlock(int32_t inode_index, int32_t index){
+  int32_t block_index = inodes[inode_index].blocks[index];
+  if (block_index != HOLE_BLOCK && block_refs[block_index - FIRST_DATA_BLOCK] == 0) {
+    return block_index;
+  }
+  int32_t copy = findFreeBlock();
+  if (copy == -1) {
+    return -1;
+  }
+  free_blocks[copy - FIRST_DATA_BLOCK] = 0;
+  touchBlock(copy);
+  if (block_index == HOLE_BLOCK) {
+    memset(data[copy], 0, BLOCK_SIZE);
+  }
+  else {
+    memcpy(data[copy], data[block_index], BLOCK_SIZE);
+  }
+  inodes[inode_index].blocks[index] = copy;
+  return copy;
+}
+
+// Encrypt or decrypt every stored byte of a file in place: the blocks it holds (copied
+// first if a snapshot shares them) or its inline bytes. Returns 0, or -1 with the file
+// unchanged when the image has no room for the copies.
+int chachaFile(int32_t directory_entry, const struct _cipher * cipher){
+  int32_t inode_index = directory[directory_entry].inode;
+  if (inodes[inode_index].attribute & INLINE) {
+    for (int32_t b = 0; b < (int32_t) (INLINE_MAX_SIZE / BLOCK_SIZE); b++) {
+      chachaBlock(cipher, b, inlineData(inode_index) + (size_t) b * BLOCK_SIZE);
+    }
+    return 0;
+  }
+  // every copy is made in the loop below, so they must all fit before it starts
+  int32_t needed = 0;
+  for (int32_t b = 0; b < BLOCKS_PER_FILE && inodes[inode_index].blocks[b] != -1; b++) {
+    int32_t block_index = inodes[inode_index].blocks[b];
+    if (block_index != HOLE_BLOCK && block_refs[block_index - FIRST_DATA_BLOCK] > 0) {
+      needed++;
+    }
+  }
+  int32_t available = 0;
+  for (int i = 0; i < NUM_DATA_BLOCKS && available < needed; i++) {
+    available += free_blocks[i];
+  }
+  if (available < needed) {
+    return -1;
+  }
+  for (int32_t b = 0; b < BLOCKS_PER_FILE && inodes[inode_index].blocks[b] != -1; b++) {
+    if (inodes[inode_index].blocks[b] == HOLE_BLOCK) {
+      continue;
+    }
+    int32_t block_index = cowBlock(inode_index, b);
+    chachaBlock(cipher, b, data[block_index]);
+    touchBlock(block_index);
+  }
+  return 0;
+}
+
+// Encrypt a file with the loaded key under the salt its directory entry has. Returns 0,
+// or -1 with the file left in plaintext when the image has no room to copy it away
+// from its snapshots.
+int encryptSalted(int32_t directory_entry){
+  struct _cipher cipher;
+  fileKey(directory_entry, &cipher);
+  if (chachaFile(directory_entry, &cipher) == -1) {
+    printf("Not enough disk space to copy %s away from its snapshots.\n", directory[directory_entry].filename);
+    return -1;
+  }
+  inodes[directory[directory_entry].inode].attribute |= ENCRYPTED;
+  return 0;
+}
+
+// Give a file a fresh salt and encrypt it with the loaded key. Returns 0, or -1 with
+// the file left in plaintext and its old salt when no salt can be drawn or the image
+// has no room to copy it away from its snapshots.
+int encryptFile(int32_t directory_entry){
+  if (fileSalt(directory_entry) == -1) {
+    return -1;
+  }
+  return encryptSalted(directory_entry);
+}
+
+// Take back a file that was just added: its directory entry, inode and blocks are
+// free again. The blocks are the file's own, no snapshot or pin holds them yet.
+void dropNewFile(int32_t directory_entry){
+  int32_t inode_index = directory[directory_entry].inode;
+  struct inode * node = &inodes[inode_index];
+  for (int b = 0; b < BLOCKS_PER_FILE && !(node->attribute & INLINE) && node->blocks[b] != -1; b++) {
+    if (node->blocks[b] != HOLE_BLOCK) {
+      releaseBlock(node->blocks[b]);
+    }
+  }
+  memset(node->blocks, 0xff, sizeof(node->blocks));
+  node->in_use = 0;
+  node->attribute = 0;
+  node->file_size = 0;
+  free_inodes[inode_index] = 1;
+  directory[directory_entry].in_use = 0;
+  directory[directory_entry].inode = -1;
+  memset(directory[directory_entry].filename, 0, sizeof(directory[0].filename));
+}
+
+// While a key is loaded new files are stored encrypted. Encrypt a file just added, or
+// drop it when that fails, so that it is never kept in plaintext. Returns 0 or -1.
+int encryptNewFile(int32_t directory_entry){
+  if (!master_key_loaded) {
+    return 0;
+  }
+  if (encryptFile(directory_entry) == -1) {
+    dropNewFile(directory_entry);
+    return -1;
+  }
+  return 0;
+}
+
+// Point data and the metadata regions at an image in memory.
+void setImage(uint8_t (*image)[BLOCK_SIZE]){
+  data = image;
+  directory = (struct _directoryEntry*)&data[0][0];
+  inodes = (struct inode *)&data[FIRST_INODE_BLOCK][0];
+  free_blocks = (uint8_t *)&data[FREE_BLOCK_MAP][0];
+  free_inodes = (uint8_t *)&data[FREE_INODE_MAP][0];
+}
+
+void initialization () {
+  setImage(image_buffer);
+  memset(image_name,0,64);
+  image_open = 0;
   for (int i = 0; i < NUM_FILES; i++){
     directory[i].in_use = 0;
     directory[i].inode = -1;
     free_inodes[i] = 1;
-    memset(directory[i].filename, 0, 64);
-    for (int j = 0; j < NUM_BLOCKS; j++){
+    memset(directory[i].filename, 0, sizeof(directory[0].filename));
+    for (int j = 0; j < BLOCKS_PER_FILE; j++){
       inodes[i].blocks[j] = -1;
-      inodes[i].in_use = 0;
-      inodes[i].attribute = 0;
-      inodes[i].file_size = 0;
     }
-  }  
-  for (int j = 0; j < NUM_BLOCKS; j++){
+    inodes[i].in_use = 0;
+    inodes[i].attribute = 0;
+    inodes[i].file_size = 0;
+  }
+  for (int j = 0; j < NUM_DATA_BLOCKS; j++){
     free_blocks[j] = 1;
-  } 
-  fclose(file);
+  }  
 }
+// Retrieve a file from the file system.
+void retrievefs(char * filename, char * newfilename){
+  // Search for the file in the file system directory
+  int32_t directory_entry = findDirectoryEntry(filename);
+  // If the file was not found, print an error message and return
+  if (directory_entry == -1) {
+    printf("Error: File not found.\n");
+    return;
+  }
+  int32_t inode_index = directory[directory_entry].inode;
+  struct _cipher cipher;
+  int missing;
+  struct _cipher * file_cipher = fileCipher(directory_entry, &cipher, &missing);
+  if (missing) {
+    printf("Error: %s is encrypted and no key is loaded.\n", filename);
+    return;
+  }
 
-void savefs (){
-  if (image_open == 0){
-    perror("Disk image is not open\n"); 
+  // Create a new filename if one is not provided
+  if (newfilename == NULL) {
+    newfilename = filename;
   }
-  file = fopen(image_name, "w");
-  //Save the current state of the filesystem by writing its data to a file.
-  fwrite( &data[0][0], BLOCK_SIZE, NUM_BLOCKS, file);
-  memset(image_name,0,64);
-  fclose(file);
+
+  // Open the output file for writing
+  int fd = open(newfilename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    printf("Error: Could not open output file: %s\n", newfilename);
+    perror("Opening output file returned");
+    return;
+  }
+
+  // Queue every block of the file on the I/O engine
+  printf("Writing %d bytes to %s\n", (int) inodes[inode_index].file_size, newfilename);
+  if (ftruncate(fd, inodes[inode_index].file_size) == -1) {
+    perror("Sizing output file returned");
+  }
+  struct _ioEngine * engine = ioEngine();
+  if (writeFileBlocks(engine, fd, inode_index, 0, fileBlockCount(inode_index), file_cipher) == -1 ||
+      ioDrain(engine) == -1) {
+    perror("Writing output file returned");
+  }
+
+  // Close the output file
+  close(fd);
 }
 
-void attribfs (char * filename, int attri, int set) {
-  int file_found = 0;
-  //Searches for the file in the directory and updates the corresponding inode's attribute.
-  for (int i = 0; i < NUM_FILES; i++){
-    int32_t inode_index = directory[i].inode;
-    if (directory[i].in_use && strcmp(directory[i].filename, filename) == 0) {
-      file_found = 1;
-      // if attri  = 1 (hidden) and set = 1 (set) -> set hidden 
-      if (set == 1){
-        if (attri == 1){
-          inodes[inode_index].attribute |= HIDDEN;
-        } 
-        // if attri  = 2 (readonly) and set = 1 (set) -> set readonly
-        if (attri == 2){
-          inodes[inode_index].attribute |= READONLY;
-        }
-      }
-      else{ //otherwise set = 0 (remove)
-        // if in hidden category and it is not hidden  -> remove    
-        if ((attri == 1) &&  ( inodes[i].attribute & HIDDEN ) ){
-          inodes[inode_index].attribute &= ~(HIDDEN);
-        }
-        // if in readonly category and it is not readonly  -> remove  
-        if ((attri == 2) && ( inodes[i].attribute & READONLY )){
-          inodes[inode_index].attribute &= ~(READONLY);
-          }          
-        }      
+// Print <number of bytes> bytes from the file, in hexadecimal, starting at <starting byte>
+void readfs(char * filename, int starting, int num_bytes) {
+  // Find the inode index of the file
+  int32_t directory_entry = findDirectoryEntry(filename);
+  if(directory_entry == -1){
+    printf("read: File not found\n");
+    return;
+  }
+  int32_t inode_index = directory[directory_entry].inode;
+  if (starting < 0 || num_bytes < 0 || (int64_t) starting + num_bytes > inodes[inode_index].file_size) {
+    printf("read: Range is outside the file\n");
+    return;
+  }
+  struct _cipher cipher;
+  int missing;
+  struct _cipher * file_cipher = fileCipher(directory_entry, &cipher, &missing);
+  if (missing) {
+    printf("read: %s is encrypted and no key is loaded\n", filename);
+    return;
+  }
+  
+  // Copy only the requested range; holes read as zeros
+  uint8_t* file_data = (uint8_t*) malloc(num_bytes);
+  readFileData(inode_index, starting, file_data, num_bytes, file_cipher);
+  
+  // Print the file data
+  for (int i = 0; i < num_bytes; i++) {
+    printf("%02x ", file_data[i]);
+  }
+  printf("\n");
+  
+  // Free the memory allocated for the file data buffer
+  free(file_data);
+}
+
+// Trimming. savefs and autosave checkpoints only write the data blocks in use and leave
+// the free ones as holes, so an image file takes host space for its files alone. trim
+// scrubs the free blocks in memory and punches holes with fallocate(FALLOC_FL_PUNCH_HOLE)
+// over runs of them in the open image file, as far as the file has them free too: a
+// block the file still lists as in use keeps its contents until the next save. With
+// trim on, delete does the same for the blocks of the deleted file.
+int trim_on_delete = 0;
+
+void autosaveWait();
+
+// Punch a hole over each run of data blocks set in map. Returns the bytes punched, or -1.
+int64_t punchRuns(int fd, uint8_t * map, int32_t * runs){
+  int64_t punched = 0;
+  for (int32_t b = 0; b < NUM_DATA_BLOCKS; b++) {
+    if (!map[b]) {
+      continue;
+    }
+    int32_t start = b;
+    while (b < NUM_DATA_BLOCKS && map[b]) {
+      b++;
+    }
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) (FIRST_DATA_BLOCK + start) * BLOCK_SIZE,
+                  (off_t) (b - start) * BLOCK_SIZE) == -1) {
+      return -1;
+    }
+    punched += (int64_t) (b - start) * BLOCK_SIZE;
+    (*runs)++;
+  }
+  return punched;
+}
+
+// Scrub the free blocks set in freed and punch them out of the image file where it has
+// them free as well. *pending counts the ones left for the next save. Returns the bytes
+// punched, or -1. The caller waits for a checkpoint in flight first (autosaveWait): it
+// renames a new image file into place and only then brings saved_free up to date.
+int64_t trimBlocks(uint8_t * freed, int32_t * runs, int32_t * pending){
+  for (int32_t b = 0; b < NUM_DATA_BLOCKS; b++) {
+    freed[b] = freed[b] && free_blocks[b];
+    if (freed[b]) {
+      memset(data[FIRST_DATA_BLOCK + b], 0, BLOCK_SIZE);
+      if (!saved_free[b]) {
+        freed[b] = 0;
+        (*pending)++;
       }
-      break;
     }
-  if (!file_found) {
-    printf("File not found\n");
-  }  
-}
+  }
+  // a compact image file does not hold free blocks to begin with
+  if (image_compact) {
+    return 0;
+  }
+  int fd = open(image_name, O_WRONLY);
+  if (fd == -1) {
+    return -1;
+  }
+  int64_t punched = punchRuns(fd, freed, runs);
+  close(fd);
+  return punched;
+}
+
+void trimfs(char * mode){
+  if (!image_open) {
+    printf("trim: Disk image is not open\n");
+    return;
+  }
+  if (mode != NULL) {
+    if (strcmp(mode, "on") != 0 && strcmp(mode, "off") != 0) {
+      printf("trim: Expected on or off\n");
+      return;
+    }
+    trim_on_delete = strcmp(mode, "on") == 0;
+    return;
+  }
+  autosaveWait();
+  struct stat before, after;
+  if (stat(image_name, &before) == -1) {
+    perror("trim");
+    return;
+  }
+  uint8_t * freed = (uint8_t *) malloc(NUM_DATA_BLOCKS);
+  memcpy(freed, free_blocks, NUM_DATA_BLOCKS);
+  int32_t runs = 0, pending = 0;
+  int64_t punched = trimBlocks(freed, &runs, &pending);
+  free(freed);
+  if (punched == -1) {
+    perror("trim");
+    return;
+  }
+  stat(image_name, &after);
+  printf("trim: %d free runs punched, image file %lld KiB -> %lld KiB on the host, %d KiB more after savefs\n",
+         runs, (long long) before.st_blocks / 2, (long long) after.st_blocks / 2, pending * BLOCK_SIZE / 1024);
+}
+
+void deletefs (char * filename) {
+  int file_found = 0;
+  int32_t inode_index = -1;
+  int32_t block_index = -1;
+
+  if (trim_on_delete) {
+    autosaveWait();
+  }
+  // finding inode of that filename
+  for (int i =- 0; i < NUM_FILES; i++){
+    if(directory[i].in_use && strcmp(directory[i].filename, filename) == 0){
+      inode_index = directory[i].inode;
+      directory[i].in_use = 0;
+      directory[i].inode = -1;
+      memset(directory[i].filename, 0, sizeof(directory[0].filename));
+      file_found = 1;
+      break;
+    }
+  }
+  if(!file_found){
+    printf("Error: file not found\n");
+    return;
+  }
+  // an inline file has no blocks, only its bytes in the block list
+  if (inodes[inode_index].attribute & INLINE) {
+    memset(inodes[inode_index].blocks, 0xff, sizeof(inodes[inode_index].blocks));
+  }
+  // free all blocks used by file
+  uint8_t * freed = trim_on_delete ? (uint8_t *) calloc(NUM_DATA_BLOCKS, 1) : NULL;
+  for(int i = 0; i < BLOCKS_PER_FILE; i++){
+    block_index = inodes[inode_index].blocks[i];
+    if (block_index == HOLE_BLOCK){
+      inodes[inode_index].blocks[i] = -1;
+    }
+    else if (block_index != -1){
+      releaseBlock(block_index);
+      inodes[inode_index].blocks[i] = -1;
+      if (freed != NULL) {
+        freed[block_index - FIRST_DATA_BLOCK] = 1;
+      }
+    }
+  }
+  if (freed != NULL) {
+    int32_t runs = 0, pending = 0;
+    if (trimBlocks(freed, &runs, &pending) == -1) {
+      perror("delete: trim");
+    }
+    free(freed);
+  }
+  // free that inode then update the variables
+  free_inodes[inode_index] = 1;
+  inodes[inode_index].in_use = 0;
+  inodes[inode_index].attribute = 0;
+  inodes[inode_index].file_size = 0;
+  printf("%s deleted!", filename);
+}
+
+void undelfs (char * filename) {
+  int32_t inode_index = -1;
+  // searching for the inode index of the file in the directory
+  for (int i = 0; i < NUM_FILES; i++){
+    if(directory[i].in_use && strcmp(directory[i].filename, filename) == 0){
+      inode_index = directory[i].inode;
+      // marking the inode and directory entry as in use
+      directory[i].in_use = 1;
+      inodes[inode_index].in_use = 1;
+      printf("%s undeleted", filename);
+      return;
+    }  
+  }
+  // if file not found
+  printf("Can not find the file.\n");
+}
+
+void listfs () {
+  int not_found = 1;
+  for (int i = 0; i < NUM_FILES; i++){
+    if (!directory[i].in_use) {
+      continue;
+    }
+    struct inode * node = &inodes[directory[i].inode];
+    // hidden files are only listed with -h
+    if (!show_hidden && (node->attribute & HIDDEN)) {
+      continue;
+    }
+    not_found = 0;
+    // if -a parameter is provided, list the attributes as an 8-bit binary value and
+    // the space the file really takes next to its logical size
+    if (show_attributes) {
+      char bits[9];
+      for (int b = 0; b < 8; b++) {
+        bits[b] = (node->attribute & (0x80 >> b)) ? '1' : '0';
+      }
+      bits[8] = '\0';
+      printf("%-32s %8u bytes %8d allocated %s\n", directory[i].filename, node->file_size,
+             allocatedBlocks(node) * BLOCK_SIZE, bits);
+    }
+    else {
+      printf("%-32s %8u bytes\n", directory[i].filename, node->file_size);
+    }
+  }
+  if (not_found){
+    printf("list: No files found.\n");
+    return;
+  }
+}
+
+int dffs() {
+  int count = 0;
+  // Count the total amount of free space in the filesystem 
+  //by counting the number of free blocks and multiplying it by the block size.
+  for (int i = 0; i < NUM_DATA_BLOCKS; i++){
+    if (free_blocks[i]){
+      count++;
+    }
+  }
+  return count * BLOCK_SIZE;  
+}
+
+void insertfs (char * filename){
+  //check for NULL in filename
+  if (filename == NULL){
+    perror("Filename is NULL\n");
+    return;
+  }
+  //check if the file is exists
+  struct stat buf;
+  int ret = stat (filename, &buf);
+  if (ret == -1) {
+    perror("File is not exist\n");
+    return;
+  }
+  //check if the file name too long
+  if (strlen(filename) > MAX_NAME_SIZE) {
+    perror("File name too long\n");
+    return;
+  }
+  //check if the file is too big
+  if(buf.st_size > MAX_FILE_SIZE){
+    perror("File is too big");
+    return;
+  }
+  //check if there is enough disk space
+  if(buf.st_size > dffs()){
+    perror("Not enough disk space");
+    return;
+  }
+  // find empty directory entry
+  else{
+    int directory_entry = -1;
+    for (int i = 0; i < NUM_FILES; i ++){
+      if(directory[i].in_use == 0){
+        directory_entry = i;
+        break;  
+      }
+    }
+    if (directory_entry == -1) {
+      perror("Failed to find a free directory entry\n");
+      return;
+    }
+    FILE *ifp = fopen (filename, "r" ); 
+    if (ifp == NULL) {
+      printf("insert error: %s: %s\n", filename, strerror(errno));
+      return;
+    }
+    printf("Reading %d bytes from %s\n", (int) buf . st_size, filename);
+    // Save off the size of the input file since we'll use it in a couple of places and 
+    // also initialize our index variables to zero. 
+    int copy_size   = buf . st_size;
+    // We want to copy and write in chunks of BLOCK_SIZE. So to do this 
+    // we are going to use fseek to move along our file stream in chunks of BLOCK_SIZE.
+    // We will copy bytes, increment our file pointer by BLOCK_SIZE and repeat.
+    int offset      = 0;     
+    // We are going to copy and store our file in BLOCK_SIZE chunks instead of one big 
+    // memory pool. Why? We are simulating the way the file system stores file data in
+    // blocks of space on the disk. block_index will keep us pointing to the area of
+    // the area that we will read from or write to.          
+    int block_index = -1;
+    //find a free inode
+    int32_t inode_index = findFreeInode();
+    if(inode_index == -1){
+      perror("Failed to find free inode\n");
+      return;
+    }
+    //place the file in the directory
+    directory[directory_entry].in_use = 1;
+    directory[directory_entry].inode = inode_index;
+    strncpy(directory[directory_entry].filename,filename, strlen(filename));
+    inodes[inode_index].file_size = buf.st_size;
+    // copy_size is initialized to the size of the input file so each loop iteration we
+    // will copy BLOCK_SIZE bytes from the file then reduce our copy_size counter by
+    // BLOCK_SIZE number of bytes. When copy_size is less than or equal to zero we know
+    // we have copied all the data from the input file.
+    inodes[inode_index].in_use = 1;
+    inodes[inode_index].attribute = 0;
+    free_inodes[inode_index] = 0;
+    // The reads are queued on the I/O engine so that many of them are in flight at
+    // once; they all complete in ioDrain below.
+    struct _ioEngine * engine = ioEngine();
+    // A small file is read straight into its inode and takes no blocks.
+    if (copy_size <= (int) INLINE_MAX_SIZE) {
+      inodes[inode_index].attribute = INLINE;
+      memset(inlineData(inode_index), 0, INLINE_MAX_SIZE);
+      if (copy_size > 0) {
+        ioQueue(engine, IO_READ, fileno(ifp), inlineData(inode_index), copy_size, 0);
+      }
+      copy_size = 0;
+    }
+    while( copy_size > 0 ){
+      // Index into the input file by offset number of bytes.  Initially offset is set to
+      // zero so we copy BLOCK_SIZE number of bytes from the front of the file.  We 
+      // then increase the offset by BLOCK_SIZE and continue the process.  This will
+      // make us copy from offsets 0, BLOCK_SIZE, 2*BLOCK_SIZE, 3*BLOCK_SIZE, etc.
+      //find a free_blocks
+      block_index = findFreeBlock();
+      if (block_index == -1){
+        perror("Failed to find free block\n");
+        ioDrain(engine);
+        dropNewFile(directory_entry);
+        fclose( ifp );
+        return;
+      }
+      // The read below is only queued, so take the block now or the next
+      // findFreeBlock would hand out the same one.
+      free_blocks[block_index - FIRST_DATA_BLOCK] = 0;
+      touchBlock(block_index);
+      // Queue a read of BLOCK_SIZE bytes (fewer for the last block) from the input
+      // file into our data array.
+      int32_t bytes = copy_size < BLOCK_SIZE ? copy_size : BLOCK_SIZE;
+      memset(data[block_index] + bytes, 0, BLOCK_SIZE - bytes);
+      ioQueue(engine, IO_READ, fileno(ifp), data[block_index], bytes, offset);
+      // save the block in the inode
+      int32_t inode_block = findFreeInodeBlock(inode_index);
+      inodes[inode_index].blocks[inode_block] = block_index;
+      // Reduce copy_size by the BLOCK_SIZE bytes.
+      copy_size -= BLOCK_SIZE;
+      // Increase the offset into our input file by BLOCK_SIZE.
+      offset    += BLOCK_SIZE;
+    }
+    // If fewer bytes than the file size arrived then something is wrong, and the
+    // file is not kept with blocks that were never filled.
+    if (ioDrain(engine) != buf.st_size) {
+      perror("An error occured reading from the input file.\n");
+      dropNewFile(directory_entry);
+      fclose( ifp );
+      return;
+    }
+    // Blocks that came in as all zeros are given back and become holes.
+    punchZeroBlocks(inode_index);
+    if (encryptNewFile(directory_entry) == -1) {
+      printf("insert error: %s could not be encrypted and was not added.\n", filename);
+    }
+    // We are done copying from the input file so close it out.
+    fclose( ifp );
+  }
+}
+
+// Bulk insert. Every path, glob and directory on the command line is expanded into
+// one batch, the free maps are walked once to reserve directory entries, inodes and
+// data blocks for the whole batch, a pool of I/O threads reads the host files straight
+// into their reserved blocks through their own I/O engine, and the directory and inode table are only updated once
+// every worker has finished.
+#define MAX_IO_THREADS 8 // upper bound on the I/O worker pool used by bulk commands
+
+struct _batchFile {
+  char path[PATH_MAX];
+  char name[64];
+  off_t size;
+  int32_t directory_entry;
+  int32_t inode;
+  int32_t num_blocks;
+  int32_t blocks[BLOCKS_PER_FILE];
+  int encrypted; // the worker encrypts the file with the key loaded when it was planned
+  int status; // 0 once a worker has copied every byte into the image
+};
+
+struct _batch {
+  struct _batchFile * files;
+  int count;
+  atomic_int next; // next file to hand to a worker
+};
+
+// Queue one host file. The file is stored under its base name.
+void batchAdd(struct _batch * batch, char * path){
+  struct stat buf;
+  if (stat(path, &buf) == -1) {
+    printf("insert error: %s: %s\n", path, strerror(errno));
+    return;
+  }
+  if (!S_ISREG(buf.st_mode)) {
+    return;
+  }
+  char * name = strrchr(path, '/');
+  name = (name == NULL) ? path : name + 1;
+  if (strlen(name) > MAX_NAME_SIZE) {
+    printf("insert error: %s: File name too long.\n", path);
+    return;
+  }
+  if (buf.st_size > MAX_FILE_SIZE) {
+    printf("insert error: %s: File is too big.\n", path);
+    return;
+  }
+  if (findDirectoryEntry(name) != -1) {
+    printf("insert error: %s already exists.\n", name);
+    return;
+  }
+  for (int i = 0; i < batch->count; i++) {
+    if (strcmp(batch->files[i].name, name) == 0) {
+      printf("insert error: %s given more than once.\n", name);
+      return;
+    }
+  }
+  if (batch->count == NUM_FILES) {
+    printf("insert error: %s: Too many files.\n", path);
+    return;
+  }
+  struct _batchFile * entry = &batch->files[batch->count++];
+  memset(entry, 0, sizeof(struct _batchFile));
+  strncpy(entry->path, path, PATH_MAX - 1);
+  strncpy(entry->name, name, 63);
+  entry->size = buf.st_size;
+  entry->num_blocks = (buf.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  entry->status = -1;
+}
+
+// Expand a directory into its regular files and a glob into its matches.
+void batchExpand(struct _batch * batch, char * arg){
+  struct stat buf;
+  if (stat(arg, &buf) == 0 && S_ISDIR(buf.st_mode)) {
+    DIR * dir = opendir(arg);
+    if (dir == NULL) {
+      printf("insert error: %s: %s\n", arg, strerror(errno));
+      return;
+    }
+    struct dirent * ent;
+    while ((ent = readdir(dir)) != NULL) {
+      char path[PATH_MAX];
+      snprintf(path, PATH_MAX, "%s/%s", arg, ent->d_name);
+      batchAdd(batch, path);
+    }
+    closedir(dir);
+    return;
+  }
+  glob_t matches;
+  if (glob(arg, GLOB_NOCHECK, NULL, &matches) != 0) {
+    printf("insert error: %s: No match.\n", arg);
+    return;
+  }
+  for (size_t i = 0; i < matches.gl_pathc; i++) {
+    batchAdd(batch, matches.gl_pathv[i]);
+  }
+  globfree(&matches);
+}
+
+// Reserve a directory entry, an inode and data blocks for every queued file in a
+// single pass over the free maps. Nothing is marked used until the batch commits.
+int batchPlan(struct _batch * batch){
+  int32_t entry_cursor = 0;
+  int32_t inode_cursor = 0;
+  int32_t block_cursor = 0;
+  for (int i = 0; i < batch->count; i++) {
+    struct _batchFile * entry = &batch->files[i];
+    while (entry_cursor < NUM_FILES && directory[entry_cursor].in_use) {
+      entry_cursor++;
+    }
+    while (inode_cursor < NUM_FILES && !free_inodes[inode_cursor]) {
+      inode_cursor++;
+    }
+    if (entry_cursor == NUM_FILES || inode_cursor == NUM_FILES) {
+      printf("insert error: Not enough directory entries for %d files.\n", batch->count);
+      return -1;
+    }
+    entry->directory_entry = entry_cursor++;
+    entry->inode = inode_cursor++;
+    // small files go into their inode
+    if (entry->size <= (off_t) INLINE_MAX_SIZE) {
+      entry->num_blocks = 0;
+    }
+    entry->encrypted = master_key_loaded;
+    if (entry->encrypted && fileSalt(entry->directory_entry) == -1) {
+      return -1;
+    }
+    for (int b = 0; b < entry->num_blocks; b++) {
+      while (block_cursor < NUM_DATA_BLOCKS && !free_blocks[block_cursor]) {
+        block_cursor++;
+      }
+      if (block_cursor == NUM_DATA_BLOCKS) {
+        printf("insert error: Not enough disk space.\n");
+        return -1;
+      }
+      entry->blocks[b] = FIRST_DATA_BLOCK + block_cursor++;
+    }
+  }
+  return 0;
+}
+
+// Copy one host file into its reserved blocks, one read request per block.
+void batchCopy(struct _ioEngine * engine, struct _batchFile * entry){
+  int fd = open(entry->path, O_RDONLY);
+  if (fd == -1) {
+    return;
+  }
+  off_t remaining = entry->size;
+  // the inode was reserved for this file alone, so its block list can take the bytes now
+  if (entry->size <= (off_t) INLINE_MAX_SIZE) {
+    memset(inlineData(entry->inode), 0, INLINE_MAX_SIZE);
+    if (entry->size > 0) {
+      ioQueue(engine, IO_READ, fd, inlineData(entry->inode), entry->size, 0);
+    }
+  }
+  for (int b = 0; b < entry->num_blocks; b++) {
+    uint32_t len = remaining < BLOCK_SIZE ? remaining : BLOCK_SIZE;
+    // the tail of the last block would otherwise keep whatever was there before
+    memset(data[entry->blocks[b]] + len, 0, BLOCK_SIZE - len);
+    ioQueue(engine, IO_READ, fd, data[entry->blocks[b]], len, (off_t) b * BLOCK_SIZE);
+    remaining -= len;
+  }
+  long bytes = ioDrain(engine);
+  close(fd);
+  if (bytes != entry->size) {
+    return;
+  }
+  // all-zero blocks are left as they are to become holes
+  if (entry->encrypted) {
+    struct _cipher cipher;
+    fileKey(entry->directory_entry, &cipher);
+    for (int b = 0; b < (int) (INLINE_MAX_SIZE / BLOCK_SIZE) && entry->num_blocks == 0; b++) {
+      chachaBlock(&cipher, b, inlineData(entry->inode) + (size_t) b * BLOCK_SIZE);
+    }
+    for (int b = 0; b < entry->num_blocks; b++) {
+      if (!blockIsZero(data[entry->blocks[b]])) {
+        chachaBlock(&cipher, b, data[entry->blocks[b]]);
+      }
+    }
+  }
+  entry->status = 0;
+}
+
+void * batchWorker(void * arg){
+  struct _batch * batch = (struct _batch *) arg;
+  struct _ioEngine engine;
+  ioEngineOpen(&engine);
+  int index;
+  while ((index = atomic_fetch_add(&batch->next, 1)) < batch->count) {
+    batchCopy(&engine, &batch->files[index]);
+  }
+  ioEngineDestroy(&engine);
+  return NULL;
+}
+
+// Number of workers for count independent jobs.
+int ioThreads(int count){
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = cpus > 0 ? (int) cpus : 1;
+  if (threads > MAX_IO_THREADS) {
+    threads = MAX_IO_THREADS;
+  }
+  if (threads > count) {
+    threads = count;
+  }
+  return threads < 1 ? 1 : threads;
+}
+
+void insertbatchfs(char ** paths, int count){
+  struct _batch batch;
+  batch.files = (struct _batchFile *) malloc(NUM_FILES * sizeof(struct _batchFile));
+  batch.count = 0;
+  atomic_init(&batch.next, 0);
+  for (int i = 0; i < count; i++) {
+    if (paths[i] != NULL) {
+      batchExpand(&batch, paths[i]);
+    }
+  }
+  if (batch.count == 0 || batchPlan(&batch) == -1) {
+    free(batch.files);
+    return;
+  }
+
+  // workers take files off a shared counter, so fewer threads still copy everything
+  // and with none at all this thread does the work
+  pthread_t workers[MAX_IO_THREADS];
+  int threads = ioThreads(batch.count);
+  int started = 0;
+  while (started < threads && pthread_create(&workers[started], NULL, batchWorker, &batch) == 0) {
+    started++;
+  }
+  if (started == 0) {
+    batchWorker(&batch);
+  }
+  for (int t = 0; t < started; t++) {
+    pthread_join(workers[t], NULL);
+  }
+
+  // commit every file that was copied in full; reservations of failed files are dropped
+  int inserted = 0;
+  long bytes = 0;
+  for (int i = 0; i < batch.count; i++) {
+    struct _batchFile * entry = &batch.files[i];
+    int32_t inode_index = entry->inode;
+    int is_inline = entry->size <= (off_t) INLINE_MAX_SIZE;
+    if (entry->status != 0) {
+      printf("insert error: An error occured reading from %s.\n", entry->path);
+      if (is_inline) {
+        memset(inodes[inode_index].blocks, 0xff, sizeof(inodes[inode_index].blocks));
+      }
+      continue;
+    }
+    for (int b = 0; b < BLOCKS_PER_FILE && !is_inline; b++) {
+      inodes[inode_index].blocks[b] = b < entry->num_blocks ? entry->blocks[b] : -1;
+    }
+    // reserved blocks that came in as all zeros are left free and become holes
+    for (int b = 0; b < entry->num_blocks; b++) {
+      if (blockIsZero(data[entry->blocks[b]])) {
+        inodes[inode_index].blocks[b] = HOLE_BLOCK;
+      }
+      else {
+        free_blocks[entry->blocks[b] - FIRST_DATA_BLOCK] = 0;
+        touchBlock(entry->blocks[b]);
+      }
+    }
+    inodes[inode_index].in_use = 1;
+    inodes[inode_index].attribute = (is_inline ? INLINE : 0) | (entry->encrypted ? ENCRYPTED : 0);
+    inodes[inode_index].file_size = entry->size;
+    free_inodes[inode_index] = 0;
+    directory[entry->directory_entry].in_use = 1;
+    directory[entry->directory_entry].inode = inode_index;
+    memset(directory[entry->directory_entry].filename, 0, sizeof(directory[0].filename));
+    strcpy(directory[entry->directory_entry].filename, entry->name);
+    inserted++;
+    bytes += entry->size;
+  }
+  printf("Inserted %d files, %ld bytes\n", inserted, bytes);
+  free(batch.files);
+}
+
+// Parallel export. Every live file matching the pattern is written to dir. Files are
+// cut into jobs of EXPORT_CHUNK_BLOCKS blocks so that one large file is spread over
+// several workers; each job writes its range with a positional write, so the jobs of
+// one file need no ordering between them.
+#define EXPORT_CHUNK_BLOCKS 128
+
+struct _exportJob {
+  int fd;
+  struct _cipher * cipher; // NULL for a plaintext file
+  int32_t inode;
+  int32_t first;
+  int32_t count;
+};
+
+struct _export {
+  struct _exportJob * jobs;
+  int count;
+  atomic_int next;
+  atomic_int errors;
+};
+
+void * exportWorker(void * arg){
+  struct _export * export = (struct _export *) arg;
+  struct _ioEngine engine;
+  ioEngineOpen(&engine);
+  int index;
+  while ((index = atomic_fetch_add(&export->next, 1)) < export->count) {
+    struct _exportJob * job = &export->jobs[index];
+    if (writeFileBlocks(&engine, job->fd, job->inode, job->first, job->count, job->cipher) == -1 ||
+        ioDrain(&engine) == -1) {
+      atomic_fetch_add(&export->errors, 1);
+    }
+  }
+  ioEngineDestroy(&engine);
+  return NULL;
+}
+
+void exportfs(char * dirname, char * pattern){
+  if (mkdir(dirname, 0755) == -1 && errno != EEXIST) {
+    printf("export error: %s: %s\n", dirname, strerror(errno));
+    return;
+  }
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  struct _export export;
+  export.jobs = (struct _exportJob *) malloc(NUM_FILES * (BLOCKS_PER_FILE / EXPORT_CHUNK_BLOCKS + 1) *
+                                             sizeof(struct _exportJob));
+  export.count = 0;
+  atomic_init(&export.next, 0);
+  atomic_init(&export.errors, 0);
+  int fds[NUM_FILES];
+  struct _cipher * ciphers = (struct _cipher *) malloc(NUM_FILES * sizeof(struct _cipher));
+  int files = 0;
+  long bytes = 0;
+
+  for (int i = 0; i < NUM_FILES; i++) {
+    if (!directory[i].in_use) {
+      continue;
+    }
+    if (pattern != NULL && fnmatch(pattern, directory[i].filename, 0) != 0) {
+      continue;
+    }
+    int missing;
+    struct _cipher * cipher = fileCipher(i, &ciphers[files], &missing);
+    if (missing) {
+      printf("export error: %s is encrypted and no key is loaded\n", directory[i].filename);
+      continue;
+    }
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%s", dirname, directory[i].filename);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+      printf("export error: %s: %s\n", path, strerror(errno));
+      continue;
+    }
+    int32_t inode_index = directory[i].inode;
+    int32_t num_blocks = fileBlockCount(inode_index);
+    // sizing the file up front leaves holes where the image has them
+    if (ftruncate(fd, inodes[inode_index].file_size) == -1) {
+      printf("export error: %s: %s\n", path, strerror(errno));
+    }
+    for (int32_t first = 0; first < num_blocks; first += EXPORT_CHUNK_BLOCKS) {
+      struct _exportJob * job = &export.jobs[export.count++];
+      job->fd = fd;
+      job->cipher = cipher;
+      job->inode = inode_index;
+      job->first = first;
+      job->count = num_blocks - first < EXPORT_CHUNK_BLOCKS ? num_blocks - first : EXPORT_CHUNK_BLOCKS;
+    }
+    fds[files++] = fd;
+    bytes += inodes[inode_index].file_size;
+  }
+
+  pthread_t workers[MAX_IO_THREADS];
+  int threads = ioThreads(export.count);
+  int started = 0;
+  while (started < threads && pthread_create(&workers[started], NULL, exportWorker, &export) == 0) {
+    started++;
+  }
+  if (started == 0) {
+    exportWorker(&export);
+  }
+  for (int t = 0; t < started; t++) {
+    pthread_join(workers[t], NULL);
+  }
+  for (int i = 0; i < files; i++) {
+    close(fds[i]);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  if (atomic_load(&export.errors) > 0) {
+    printf("export error: %d writes failed\n", atomic_load(&export.errors));
+  }
+  printf("Exported %d files, %ld bytes in %.3f s (%.1f files/s, %.1f MB/s)\n", files, bytes, seconds,
+         seconds > 0 ? files / seconds : 0.0, seconds > 0 ? bytes / seconds / 1e6 : 0.0);
+  free(export.jobs);
+  free(ciphers);
+}
+
+// Streaming tar. import-tar and export-tar move a POSIX ustar archive between a file
+// descriptor and the image without staging anything on the host: data goes through
+// a TAR_BUFFER_SIZE buffer on export and straight into freshly allocated blocks on
+// import. "-" selects stdin/stdout.
+#define TAR_RECORD 512
+#define TAR_BUFFER_SIZE 65536
+
+struct _tarHeader {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char pad[12];
+};
+
+// Read exactly len bytes unless the stream ends first. Returns the bytes read or -1.
+ssize_t readFull(int fd, void * buf, size_t len){
+  size_t total = 0;
+  while (total < len) {
+    ssize_t bytes = read(fd, (uint8_t *) buf + total, len - total);
+    if (bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (bytes == 0) {
+      break;
+    }
+    total += bytes;
+  }
+  return total;
+}
+
+// Read up to len bytes from source, "-" for stdin, which may keep us waiting for as
+// long as its producer likes: opening a FIFO waits for a writer, and reading it for
+// data. Called with image_mutex held, as commands are; it is released for the wait, so
+// the autosave thread and background readers carry on, and held again on return. Those
+// only take checkpoints and give back pinned blocks, so the caller may rely on the
+// directory but must look at free_blocks afresh. Returns the bytes read, or -1 with errno set.
+ssize_t readStream(char * source, void * buf, size_t len){
+  pthread_mutex_unlock(&image_mutex);
+  int fd = strcmp(source, "-") == 0 ? STDIN_FILENO : open(source, O_RDONLY);
+  ssize_t bytes = fd == -1 ? -1 : readFull(fd, buf, len);
+  int error = errno;
+  if (fd != -1 && fd != STDIN_FILENO) {
+    close(fd);
+  }
+  pthread_mutex_lock(&image_mutex);
+  errno = error;
+  return bytes;
+}
+
+int writeFull(int fd, const void * buf, size_t len){
+  size_t total = 0;
+  while (total < len) {
+    ssize_t bytes = write(fd, (const uint8_t *) buf + total, len - total);
+    if (bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    total += bytes;
+  }
+  return 0;
+}
+
+unsigned int tarChecksum(struct _tarHeader * header){
+  unsigned int sum = 0;
+  uint8_t * bytes = (uint8_t *) header;
+  for (size_t i = 0; i < TAR_RECORD; i++) {
+    // the checksum field itself counts as eight spaces
+    if (i >= offsetof(struct _tarHeader, chksum) && i < offsetof(struct _tarHeader, chksum) + 8) {
+      sum += ' ';
+    }
+    else {
+      sum += bytes[i];
+    }
+  }
+  return sum;
+}
+
+void exporttarfs(char * archive){
+  int fd = strcmp(archive, "-") == 0 ? STDOUT_FILENO : open(archive, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    fprintf(stderr, "export-tar error: %s: %s\n", archive, strerror(errno));
+    exit_status = 1;
+    return;
+  }
+  uint8_t * buffer = (uint8_t *) malloc(TAR_BUFFER_SIZE);
+  size_t used = 0;
+  int failed = 0;
+  int files = 0;
+  for (int i = 0; i < NUM_FILES && !failed; i++) {
+    if (!directory[i].in_use) {
+      continue;
+    }
+    int32_t inode_index = directory[i].inode;
+    uint32_t size = inodes[inode_index].file_size;
+    struct _cipher cipher;
+    int missing;
+    struct _cipher * file_cipher = fileCipher(i, &cipher, &missing);
+    if (missing) {
+      fprintf(stderr, "export-tar error: %s is encrypted and no key is loaded\n", directory[i].filename);
+      exit_status = 1;
+      continue;
+    }
+
+    struct _tarHeader header;
+    memset(&header, 0, sizeof(header));
+    strncpy(header.name, directory[i].filename, sizeof(header.name) - 1);
+    snprintf(header.mode, sizeof(header.mode), "%07o", 0644);
+    snprintf(header.uid, sizeof(header.uid), "%07o", 0);
+    snprintf(header.gid, sizeof(header.gid), "%07o", 0);
+    snprintf(header.size, sizeof(header.size), "%011o", size);
+    snprintf(header.mtime, sizeof(header.mtime), "%011lo", (unsigned long) time(NULL));
+    header.typeflag = '0';
+    memcpy(header.magic, "ustar", 6);
+    memcpy(header.version, "00", 2);
+    snprintf(header.chksum, sizeof(header.chksum), "%06o", tarChecksum(&header));
+    header.chksum[7] = ' ';
+
+    // header, then the data padded to a whole record, always through the same buffer
+    uint32_t padded = (size + TAR_RECORD - 1) / TAR_RECORD * TAR_RECORD;
+    uint32_t offset = 0;
+    memcpy(buffer + used, &header, TAR_RECORD);
+    used += TAR_RECORD;
+    while (offset < padded) {
+      if (used == TAR_BUFFER_SIZE) {
+        if (writeFull(fd, buffer, used) == -1) {
+          failed = 1;
+          break;
+        }
+        used = 0;
+      }
+      uint32_t chunk = padded - offset;
+      if (chunk > TAR_BUFFER_SIZE - used) {
+        chunk = TAR_BUFFER_SIZE - used;
+      }
+      uint32_t bytes = offset < size ? (size - offset < chunk ? size - offset : chunk) : 0;
+      readFileData(inode_index, offset, buffer + used, bytes, file_cipher);
+      memset(buffer + used + bytes, 0, chunk - bytes);
+      used += chunk;
+      offset += chunk;
+    }
+    if (used == TAR_BUFFER_SIZE && !failed) {
+      failed = writeFull(fd, buffer, used) == -1;
+      used = 0;
+    }
+    files++;
+  }
+  // end of archive: two zero records
+  if (!failed) {
+    if (used + 2 * TAR_RECORD > TAR_BUFFER_SIZE) {
+      failed = writeFull(fd, buffer, used) == -1;
+      used = 0;
+    }
+    memset(buffer + used, 0, 2 * TAR_RECORD);
+    used += 2 * TAR_RECORD;
+    failed = failed || writeFull(fd, buffer, used) == -1;
+  }
+  if (failed) {
+    fprintf(stderr, "export-tar error: %s\n", strerror(errno));
+    exit_status = 1;
+  }
+  else {
+    fprintf(stderr, "Exported %d files to %s\n", files, archive);
+  }
+  free(buffer);
+  if (fd != STDOUT_FILENO) {
+    close(fd);
+  }
+}
+
+// Skip len bytes of the archive.
+int tarSkip(int fd, uint64_t len){
+  uint8_t buffer[TAR_RECORD * 8];
+  while (len > 0) {
+    size_t chunk = len < sizeof(buffer) ? len : sizeof(buffer);
+    if (readFull(fd, buffer, chunk) != (ssize_t) chunk) {
+      return -1;
+    }
+    len -= chunk;
+  }
+  return 0;
+}
+
+void importtarfs(char * archive){
+  int fd = strcmp(archive, "-") == 0 ? STDIN_FILENO : open(archive, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "import-tar error: %s: %s\n", archive, strerror(errno));
+    exit_status = 1;
+    return;
+  }
+  int files = 0;
+  int32_t block_cursor = 0;
+  struct _tarHeader header;
+  while (1) {
+    if (readFull(fd, &header, TAR_RECORD) != TAR_RECORD) {
+      fprintf(stderr, "import-tar error: Truncated archive.\n");
+      exit_status = 1;
+      break;
+    }
+    if (header.name[0] == '\0') {
+      break; // first of the two zero records that end the archive
+    }
+    if (strtoul(header.chksum, NULL, 8) != tarChecksum(&header)) {
+      fprintf(stderr, "import-tar error: Bad header checksum.\n");
+      exit_status = 1;
+      break;
+    }
+    uint64_t size = strtoull(header.size, NULL, 8);
+    uint64_t padding = (TAR_RECORD - size % TAR_RECORD) % TAR_RECORD;
+
+    // the directory is flat, so only regular files are kept and stored by base name
+    char name[101];
+    memcpy(name, header.name, 100);
+    name[100] = '\0';
+    char * base = strrchr(name, '/');
+    base = (base == NULL) ? name : base + 1;
+    char * reason = NULL;
+    int32_t directory_entry = -1;
+    int32_t inode_index = -1;
+    if (header.typeflag == 'L' || header.typeflag == 'K') {
+      reason = "GNU long names are not supported, the next member keeps its truncated name.";
+    }
+    else if (header.typeflag != '0' && header.typeflag != '\0') {
+      reason = "";
+    }
+    else if (strlen(base) > MAX_NAME_SIZE) {
+      reason = "File name too long.";
+    }
+    else if (size > MAX_FILE_SIZE) {
+      reason = "File is too big.";
+    }
+    else if (findDirectoryEntry(base) != -1) {
+      reason = "File already exists.";
+    }
+    else {
+      for (int i = 0; i < NUM_FILES && directory_entry == -1; i++) {
+        if (!directory[i].in_use) {
+          directory_entry = i;
+        }
+      }
+      inode_index = findFreeInode();
+      if (directory_entry == -1 || inode_index == -1) {
+        reason = "No free directory entry.";
+      }
+    }
+    if (reason != NULL) {
+      if (reason[0] != '\0') {
+        fprintf(stderr, "import-tar error: %s: %s\n", name, reason);
+        exit_status = 1;
+      }
+      if (tarSkip(fd, size + padding) == -1) {
+        fprintf(stderr, "import-tar error: Truncated archive.\n");
+        exit_status = 1;
+        break;
+      }
+      continue;
+    }
+
+    // allocate blocks as the data arrives and read straight into them; a small file
+    // is read into its inode
+    int is_inline = size <= INLINE_MAX_SIZE;
+    memset(inodes[inode_index].blocks, is_inline ? 0 : 0xff, sizeof(inodes[inode_index].blocks));
+    uint64_t remaining = size;
+    int32_t count = 0;
+    int failed = 0;
+    if (is_inline) {
+      if (readFull(fd, inlineData(inode_index), size) != (ssize_t) size) {
+        fprintf(stderr, "import-tar error: Truncated archive.\n");
+        exit_status = 1;
+        memset(inodes[inode_index].blocks, 0xff, sizeof(inodes[inode_index].blocks));
+        break;
+      }
+      remaining = 0;
+    }
+    while (remaining > 0) {
+      while (block_cursor < NUM_DATA_BLOCKS && !free_blocks[block_cursor]) {
+        block_cursor++;
+      }
+      if (block_cursor == NUM_DATA_BLOCKS) {
+        fprintf(stderr, "import-tar error: %s: Not enough disk space.\n", name);
+        exit_status = 1;
+        failed = 1;
+        break;
+      }
+      int32_t block_index = FIRST_DATA_BLOCK + block_cursor;
+      size_t chunk = remaining < BLOCK_SIZE ? remaining : BLOCK_SIZE;
+      if (readFull(fd, data[block_index], chunk) != (ssize_t) chunk) {
+        fprintf(stderr, "import-tar error: Truncated archive.\n");
+        exit_status = 1;
+        failed = 2;
+        break;
+      }
+      memset(data[block_index] + chunk, 0, BLOCK_SIZE - chunk);
+      remaining -= chunk;
+      // an all-zero block becomes a hole and the block is used for the next one
+      if (blockIsZero(data[block_index])) {
+        inodes[inode_index].blocks[count++] = HOLE_BLOCK;
+        continue;
+      }
+      free_blocks[block_cursor] = 0;
+      touchBlock(block_index);
+      inodes[inode_index].blocks[count++] = block_index;
+    }
+    if (failed) {
+      // give back the blocks of the partial file
+      for (int b = 0; b < count; b++) {
+        if (inodes[inode_index].blocks[b] != HOLE_BLOCK) {
+          free_blocks[inodes[inode_index].blocks[b] - FIRST_DATA_BLOCK] = 1;
+        }
+        inodes[inode_index].blocks[b] = -1;
+      }
+      if (failed == 2 || tarSkip(fd, remaining + padding) == -1) {
+        break;
+      }
+      continue;
+    }
+    if (tarSkip(fd, padding) == -1) {
+      fprintf(stderr, "import-tar error: Truncated archive.\n");
+      exit_status = 1;
+      break;
+    }
+    inodes[inode_index].in_use = 1;
+    inodes[inode_index].attribute = is_inline ? INLINE : 0;
+    inodes[inode_index].file_size = size;
+    free_inodes[inode_index] = 0;
+    directory[directory_entry].in_use = 1;
+    directory[directory_entry].inode = inode_index;
+    memset(directory[directory_entry].filename, 0, sizeof(directory[0].filename));
+    strcpy(directory[directory_entry].filename, base);
+    if (encryptNewFile(directory_entry) == -1) {
+      fprintf(stderr, "import-tar error: %s could not be encrypted and was not added.\n", base);
+      exit_status = 1;
+      continue;
+    }
+    files++;
+  }
+  fprintf(stderr, "Imported %d files from %s\n", files, archive);
+  if (fd != STDIN_FILENO) {
+    close(fd);
+  }
+}
+
+// Streaming insert. insertstreamfs stores a file whose size is not known up front,
+// read from stdin ("-", one-shot mode only: at the prompt stdin holds the commands)
+// or from a FIFO or character device. The producer may take its time, so the stream
+// is read into a buffer of its own by readStream, without image_mutex, and only once
+// it ends are blocks allocated and the file added. A stream that outgrows
+// MAX_FILE_SIZE is dropped, as is one that does not fit in the image.
+void insertstreamfs(char * source, char * filename){
+  if (filename == NULL) {
+    printf("insert error: No filename specified.\n");
+    return;
+  }
+  if (strlen(filename) > MAX_NAME_SIZE) {
+    printf("insert error: %s: File name too long.\n", filename);
+    return;
+  }
+  if (findDirectoryEntry(filename) != -1) {
+    printf("insert error: %s already exists.\n", filename);
+    return;
+  }
+  // one byte more than a file can hold tells a stream that is too big
+  uint8_t * buffer = (uint8_t *) malloc(MAX_FILE_SIZE + 1);
+  if (buffer == NULL) {
+    printf("insert error: %s: Out of memory.\n", source);
+    return;
+  }
+  ssize_t size = readStream(source, buffer, MAX_FILE_SIZE + 1);
+  int error = errno;
+  char * reason = NULL;
+  if (size < 0) {
+    reason = strerror(error);
+  }
+  else if (size > MAX_FILE_SIZE) {
+    reason = "File is too big.";
+  }
+  else if (findDirectoryEntry(filename) != -1) {
+    reason = "File already exists.";
+  }
+  int32_t directory_entry = -1;
+  for (int i = 0; i < NUM_FILES && directory_entry == -1; i++) {
+    if (!directory[i].in_use) {
+      directory_entry = i;
+    }
+  }
+  int32_t inode_index = findFreeInode();
+  if (reason == NULL && (directory_entry == -1 || inode_index == -1)) {
+    reason = "Too many files.";
+  }
+  if (reason != NULL) {
+    free(buffer);
+    printf("insert error: %s: %s\n", source, reason);
+    return;
+  }
+  // a stream that ends within INLINE_MAX_SIZE bytes is kept in its inode
+  int is_inline = size <= (ssize_t) INLINE_MAX_SIZE;
+  memset(inodes[inode_index].blocks, is_inline ? 0 : 0xff, sizeof(inodes[inode_index].blocks));
+  if (is_inline) {
+    memcpy(inlineData(inode_index), buffer, size);
+  }
+  int32_t count = 0;
+  int32_t block_cursor = 0;
+  for (ssize_t offset = 0; offset < size && !is_inline; offset += BLOCK_SIZE) {
+    size_t chunk = size - offset < BLOCK_SIZE ? size - offset : BLOCK_SIZE;
+    uint8_t block[BLOCK_SIZE];
+    memcpy(block, buffer + offset, chunk);
+    memset(block + chunk, 0, BLOCK_SIZE - chunk);
+    // an all-zero block becomes a hole
+    if (blockIsZero(block)) {
+      inodes[inode_index].blocks[count++] = HOLE_BLOCK;
+      continue;
+    }
+    while (block_cursor < NUM_DATA_BLOCKS && !free_blocks[block_cursor]) {
+      block_cursor++;
+    }
+    if (block_cursor == NUM_DATA_BLOCKS) {
+      reason = "Not enough disk space.";
+      break;
+    }
+    int32_t block_index = FIRST_DATA_BLOCK + block_cursor;
+    memcpy(data[block_index], block, BLOCK_SIZE);
+    free_blocks[block_cursor] = 0;
+    touchBlock(block_index);
+    inodes[inode_index].blocks[count++] = block_index;
+  }
+  free(buffer);
+  if (reason != NULL) {
+    // give back the blocks of the partial file
+    for (int b = 0; b < count; b++) {
+      if (inodes[inode_index].blocks[b] != HOLE_BLOCK) {
+        free_blocks[inodes[inode_index].blocks[b] - FIRST_DATA_BLOCK] = 1;
+      }
+    }
+    memset(inodes[inode_index].blocks, 0xff, sizeof(inodes[inode_index].blocks));
+    printf("insert error: %s: %s\n", source, reason);
+    return;
+  }
+  inodes[inode_index].in_use = 1;
+  inodes[inode_index].attribute = is_inline ? INLINE : 0;
+  inodes[inode_index].file_size = size;
+  free_inodes[inode_index] = 0;
+  directory[directory_entry].in_use = 1;
+  directory[directory_entry].inode = inode_index;
+  memset(directory[directory_entry].filename, 0, sizeof(directory[0].filename));
+  strcpy(directory[directory_entry].filename, filename);
+  if (encryptNewFile(directory_entry) == -1) {
+    printf("insert error: %s could not be encrypted and was not added.\n", filename);
+    return;
+  }
+  printf("Read %lld bytes from %s\n", (long long) size, source);
+}
+
+// In-place writes. writefs changes len bytes of a file starting at offset and touches
+// only the blocks in that range: existing blocks are modified in place (copied first
+// if a snapshot shares them), blocks past the end are allocated, and a gap between
+// the old end of the file and offset is left as holes. An inline file is changed
+// within its inode while it still fits there. Returns 0 or -1.
+
+// Move an inline file out to data blocks. Returns 0, or -1 when the image is full.
+int spillInline(int32_t inode_index){
+  struct inode * node = &inodes[inode_index];
+  int32_t num_blocks = fileBlockCount(inode_index);
+  int32_t available = 0;
+  for (int i = 0; i < NUM_DATA_BLOCKS && available < num_blocks; i++) {
+    available += free_blocks[i];
+  }
+  if (available < num_blocks) {
+    return -1;
+  }
+  uint8_t bytes[INLINE_MAX_SIZE];
+  memcpy(bytes, inlineData(inode_index), INLINE_MAX_SIZE);
+  memset(node->blocks, 0xff, sizeof(node->blocks));
+  node->attribute &= ~INLINE;
+  for (int32_t b = 0; b < num_blocks; b++) {
+    if (blockIsZero(bytes + (size_t) b * BLOCK_SIZE)) {
+      node->blocks[b] = HOLE_BLOCK;
+      continue;
+    }
+    int32_t block_index = findFreeBlock();
+    free_blocks[block_index - FIRST_DATA_BLOCK] = 0;
+    memcpy(data[block_index], bytes + (size_t) b * BLOCK_SIZE, BLOCK_SIZE);
+    touchBlock(block_index);
+    node->blocks[b] = block_index;
+  }
+  return 0;
+}
+
+int writefs(char * filename, uint32_t offset, const uint8_t * buf, uint32_t len){
+  int32_t directory_entry = findDirectoryEntry(filename);
+  if (directory_entry == -1) {
+    printf("write: File not found\n");
+    return -1;
+  }
+  int32_t inode_index = directory[directory_entry].inode;
+  struct inode * node = &inodes[inode_index];
+  if (node->attribute & READONLY) {
+    printf("write: %s is read-only\n", filename);
+    return -1;
+  }
+  if ((uint64_t) offset + len > MAX_FILE_SIZE) {
+    printf("write: File would exceed %d bytes\n", MAX_FILE_SIZE);
+    return -1;
+  }
+  struct _cipher file_key;
+  int missing;
+  struct _cipher * cipher = fileCipher(directory_entry, &file_key, &missing);
+  if (missing) {
+    printf("write: %s is encrypted and no key is loaded\n", filename);
+    return -1;
+  }
+  if (len == 0) {
+    return 0;
+  }
+  // An encrypted file is never written in place under the key it has: the ciphertext
+  // that snapshots, deltas and checkpoints keep would share keystream with the new one.
+  // It is decrypted, written as plaintext and encrypted again under a fresh salt, which
+  // costs a pass over the whole file per write.
+  if (cipher != NULL) {
+    // the salt comes first, so that without one the file is left as it was
+    uint8_t salt[sizeof(directory[0].salt)];
+    if (randomSalt(salt) == -1) {
+      return -1;
+    }
+    if (chachaFile(directory_entry, cipher) == -1) {
+      printf("write: Not enough disk space.\n");
+      return -1;
+    }
+    node->attribute &= ~ENCRYPTED;
+    if (writefs(filename, offset, buf, len) == -1) {
+      // the same key over the same plaintext gives back the ciphertext it had
+      chachaFile(directory_entry, cipher);
+      node->attribute |= ENCRYPTED;
+      return -1;
+    }
+    memcpy(directory[directory_entry].salt, salt, sizeof(salt));
+    return encryptSalted(directory_entry);
+  }
+  if (node->attribute & INLINE) {
+    if ((uint64_t) offset + len <= INLINE_MAX_SIZE) {
+      memcpy(inlineData(inode_index) + offset, buf, len);
+      if (offset + len > node->file_size) {
+        node->file_size = offset + len;
+      }
+      return 0;
+    }
+    if (spillInline(inode_index) == -1) {
+      printf("write: Not enough disk space.\n");
+      return -1;
+    }
+  }
+  int32_t first = offset / BLOCK_SIZE;
+  int32_t last = (offset + len - 1) / BLOCK_SIZE;
+
+  // count the blocks the write has to allocate so it either fits or changes nothing
+  int32_t needed = 0;
+  for (int32_t b = first; b <= last; b++) {
+    int32_t block_index = node->blocks[b];
+    if (block_index == -1 || block_index == HOLE_BLOCK || block_refs[block_index - FIRST_DATA_BLOCK] > 0) {
+      needed++;
+    }
+  }
+  int32_t available = 0;
+  for (int i = 0; i < NUM_DATA_BLOCKS && available < needed; i++) {
+    available += free_blocks[i];
+  }
+  if (available < needed) {
+    printf("write: Not enough disk space.\n");
+    return -1;
+  }
+
+  // blocks between the current end of the file and the write become holes
+  for (int32_t b = 0; b < first; b++) {
+    if (node->blocks[b] == -1) {
+      node->blocks[b] = HOLE_BLOCK;
+    }
+  }
+  uint32_t position = offset;
+  while (position < offset + len) {
+    int32_t b = position / BLOCK_SIZE;
+    uint32_t within = position % BLOCK_SIZE;
+    uint32_t chunk = BLOCK_SIZE - within < offset + len - position ? BLOCK_SIZE - within : offset + len - position;
+    if (node->blocks[b] == -1) {
+      node->blocks[b] = HOLE_BLOCK;
+    }
+    int32_t block_index = cowBlock(inode_index, b);
+    memcpy(data[block_index] + within, buf + (position - offset), chunk);
+    touchBlock(block_index);
+    position += chunk;
+  }
+  if (offset + len > node->file_size) {
+    node->file_size = offset + len;
+  }
+  return 0;
+}
+
+int appendfs(char * filename, const uint8_t * buf, uint32_t len){
+  int32_t directory_entry = findDirectoryEntry(filename);
+  if (directory_entry == -1) {
+    printf("append: File not found\n");
+    return -1;
+  }
+  return writefs(filename, inodes[directory[directory_entry].inode].file_size, buf, len);
+}
+
+// Parse "deadbeef" into bytes. Returns the number of bytes or -1.
+int parseHex(char * text, uint8_t * out, int max){
+  int len = strlen(text);
+  if (len % 2 != 0 || len / 2 > max) {
+    return -1;
+  }
+  for (int i = 0; i < len / 2; i++) {
+    unsigned int byte;
+    if (!isxdigit((unsigned char) text[2 * i]) || !isxdigit((unsigned char) text[2 * i + 1]) ||
+        sscanf(text + 2 * i, "%2x", &byte) != 1) {
+      return -1;
+    }
+    out[i] = byte;
+  }
+  return len / 2;
+}
+
+// write <file> <offset> <hexbytes|@hostfile> and append <file> <hexbytes|@hostfile>.
+// A host file is read whole, at most as much as still fits in the file, and written in
+// one writefs call, so the write either happens completely or not at all.
+void writecmdfs(char * filename, int64_t offset, char * source){
+  char * command = offset < 0 ? "append" : "write";
+  if (offset < 0) {
+    int32_t directory_entry = findDirectoryEntry(filename);
+    if (directory_entry == -1) {
+      printf("append: File not found\n");
+      return;
+    }
+    offset = inodes[directory[directory_entry].inode].file_size;
+  }
+  if (source[0] != '@') {
+    uint8_t bytes[MAX_COMMAND_SIZE / 2];
+    int len = parseHex(source, bytes, sizeof(bytes));
+    if (len == -1) {
+      printf("%s: Expected hex bytes or @hostfile\n", command);
+      return;
+    }
+    if (writefs(filename, offset, bytes, len) == 0) {
+      printf("Wrote %d bytes to %s at %ld\n", len, filename, (long) offset);
+    }
+    return;
+  }
+  int fd = open(source + 1, O_RDONLY);
+  if (fd == -1) {
+    printf("%s: %s: %s\n", command, source + 1, strerror(errno));
+    return;
+  }
+  // one byte more than fits tells a host file that is too big from one that just fits
+  size_t room = MAX_FILE_SIZE - offset;
+  uint8_t * buffer = (uint8_t *) malloc(room + 1);
+  ssize_t bytes = readFull(fd, buffer, room + 1);
+  if (bytes == -1) {
+    printf("%s: %s: %s\n", command, source + 1, strerror(errno));
+  }
+  else if ((size_t) bytes > room) {
+    printf("%s: File would exceed %d bytes\n", command, MAX_FILE_SIZE);
+  }
+  else if (writefs(filename, offset, buffer, bytes) == 0) {
+    printf("Wrote %ld bytes to %s at %ld\n", (long) bytes, filename, (long) offset);
+  }
+  free(buffer);
+  close(fd);
+}
+
+// Load the key used for encrypted files: 64 hex digits, or @file holding 32 bytes.
+int loadKey(char * text){
+  uint8_t bytes[sizeof(master_key.key)];
+  if (text[0] == '@') {
+    int fd = open(text + 1, O_RDONLY);
+    if (fd == -1 || readFull(fd, bytes, sizeof(bytes)) != (ssize_t) sizeof(bytes)) {
+      printf("key: %s does not hold a %d-byte key\n", text + 1, (int) sizeof(bytes));
+      if (fd != -1) {
+        close(fd);
+      }
+      return -1;
+    }
+    close(fd);
+  }
+  else if (parseHex(text, bytes, sizeof(bytes)) != (int) sizeof(bytes)) {
+    printf("key: Expected %d hex digits or @keyfile\n", (int) (2 * sizeof(bytes)));
+    return -1;
+  }
+  memcpy(master_key.key, bytes, sizeof(bytes));
+  master_key_loaded = 1;
+  return 0;
+}
+
+// Consistency check. The expected free maps are rebuilt from the directory and the
+// inode table and compared with the ones stored in the image. The inode table is split
+// between worker threads; each claims the blocks of its inodes in block_owner with a
+// compare-and-swap, so a block claimed twice is found without any locking.
+#define FSCK_REPORT_LIMIT 10 // problems of one kind printed before they are only counted
+
+struct _fsck {
+  int32_t owner_entry[NUM_FILES];    // directory entry owning each inode, -1 if none
+  _Atomic int32_t * block_owner;     // inode claiming each data block, -1 if none
+  int32_t * double_blocks;           // (inode, slot) pairs that lost a claim
+  atomic_int num_double;
+  atomic_int num_range;              // out-of-range block pointers
+  atomic_int next;                   // next inode to hand to a worker
+};
+
+void * fsckWorker(void * arg){
+  struct _fsck * check = (struct _fsck *) arg;
+  int inode_index;
+  while ((inode_index = atomic_fetch_add(&check->next, 1)) < NUM_FILES) {
+    if (check->owner_entry[inode_index] == -1) {
+      continue;
+    }
+    struct inode * node = &inodes[inode_index];
+    if (node->attribute & INLINE) {
+      continue;
+    }
+    for (int b = 0; b < BLOCKS_PER_FILE && node->blocks[b] != -1; b++) {
+      int32_t block_index = node->blocks[b];
+      if (block_index == HOLE_BLOCK) {
+        continue;
+      }
+      if (block_index < FIRST_DATA_BLOCK || block_index >= NUM_BLOCKS) {
+        atomic_fetch_add(&check->num_range, 1);
+        continue;
+      }
+      int32_t expected = -1;
+      if (!atomic_compare_exchange_strong(&check->block_owner[block_index - FIRST_DATA_BLOCK], &expected,
+                                          inode_index)) {
+        int index = atomic_fetch_add(&check->num_double, 1);
+        check->double_blocks[2 * index] = inode_index;
+        check->double_blocks[2 * index + 1] = b;
+      }
+    }
+  }
+  return NULL;
+}
+
+// Returns the number of problems found; with repair they are fixed as well.
+int fsckfs(int repair){
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  struct _fsck check;
+  check.block_owner = (_Atomic int32_t *) malloc(NUM_DATA_BLOCKS * sizeof(_Atomic int32_t));
+  check.double_blocks = (int32_t *) malloc(2 * NUM_FILES * BLOCKS_PER_FILE * sizeof(int32_t));
+  for (int b = 0; b < NUM_DATA_BLOCKS; b++) {
+    atomic_init(&check.block_owner[b], -1);
+  }
+  atomic_init(&check.num_double, 0);
+  atomic_init(&check.num_range, 0);
+  atomic_init(&check.next, 0);
+  int problems = 0;
+  int reported = 0;
+
+  // directory: every entry in use must name its own valid inode
+  for (int i = 0; i < NUM_FILES; i++) {
+    check.owner_entry[i] = -1;
+  }
+  for (int i = 0; i < NUM_FILES; i++) {
+    if (!directory[i].in_use) {
+      continue;
+    }
+    int32_t inode_index = directory[i].inode;
+    char * problem = NULL;
+    if (inode_index < 0 || inode_index >= NUM_FILES) {
+      problem = "points at an invalid inode";
+    }
+    else if (check.owner_entry[inode_index] != -1) {
+      problem = "shares its inode with another file";
+    }
+    if (problem != NULL) {
+      problems++;
+      if (reported++ < FSCK_REPORT_LIMIT) {
+        printf("fsck: %s %s%s\n", directory[i].filename, problem, repair ? ", entry removed" : "");
+      }
+      if (repair) {
+        directory[i].in_use = 0;
+        directory[i].inode = -1;
+        memset(directory[i].filename, 0, sizeof(directory[0].filename));
+      }
+      continue;
+    }
+    check.owner_entry[inode_index] = i;
+  }
+
+  // inodes: claim every block in parallel
+  pthread_t workers[MAX_IO_THREADS];
+  int threads = ioThreads(NUM_FILES);
+  int started = 0;
+  while (started < threads && pthread_create(&workers[started], NULL, fsckWorker, &check) == 0) {
+    started++;
+  }
+  if (started == 0) {
+    fsckWorker(&check);
+  }
+  for (int t = 0; t < started; t++) {
+    pthread_join(workers[t], NULL);
+  }
+
+  // per inode: in-use flags, out-of-range pointers and block count against file size
+  int32_t inode_problems = 0;
+  for (int i = 0; i < NUM_FILES; i++) {
+    int live = check.owner_entry[i] != -1;
+    struct inode * node = &inodes[i];
+    if (live != (node->in_use != 0)) {
+      inode_problems++;
+      if (reported++ < FSCK_REPORT_LIMIT) {
+        printf("fsck: inode %d is %s but its in-use flag is %s%s\n", i, live ? "used" : "unused",
+               node->in_use ? "set" : "clear", repair ? ", fixed" : "");
+      }
+      if (repair) {
+        node->in_use = live;
+      }
+    }
+    if (live == free_inodes[i]) {
+      inode_problems++;
+      if (reported++ < FSCK_REPORT_LIMIT) {
+        printf("fsck: inode %d is %s but the free inode map says %s%s\n", i, live ? "used" : "unused",
+               free_inodes[i] ? "free" : "allocated", repair ? ", fixed" : "");
+      }
+      if (repair) {
+        free_inodes[i] = !live;
+      }
+    }
+    if (!live) {
+      continue;
+    }
+    char * filename = directory[check.owner_entry[i]].filename;
+    if (node->attribute & INLINE) {
+      if (node->file_size > INLINE_MAX_SIZE) {
+        inode_problems++;
+        if (reported++ < FSCK_REPORT_LIMIT) {
+          printf("fsck: %s is inline but has %u bytes%s\n", filename, node->file_size,
+                 repair ? ", truncated" : "");
+        }
+        if (repair) {
+          node->file_size = INLINE_MAX_SIZE;
+        }
+      }
+      continue;
+    }
+    int32_t count = 0;
+    while (count < BLOCKS_PER_FILE && node->blocks[count] != -1) {
+      int32_t block_index = node->blocks[count];
+      if (block_index != HOLE_BLOCK && (block_index < FIRST_DATA_BLOCK || block_index >= NUM_BLOCKS)) {
+        if (reported++ < FSCK_REPORT_LIMIT) {
+          printf("fsck: %s block %d points outside the data region (%d)%s\n", filename, count, block_index,
+                 repair ? ", made a hole" : "");
+        }
+        if (repair) {
+          node->blocks[count] = HOLE_BLOCK;
+        }
+      }
+      count++;
+    }
+    int32_t expected = fileBlockCount(i);
+    if (count != expected) {
+      inode_problems++;
+      if (reported++ < FSCK_REPORT_LIMIT) {
+        printf("fsck: %s has %d blocks for %u bytes%s\n", filename, count, node->file_size,
+               repair ? (count > expected ? ", extra blocks dropped" : ", missing blocks made holes") : "");
+      }
+      if (repair) {
+        for (int32_t b = expected; b < count; b++) {
+          if (node->blocks[b] != HOLE_BLOCK && node->blocks[b] >= FIRST_DATA_BLOCK &&
+              atomic_load(&check.block_owner[node->blocks[b] - FIRST_DATA_BLOCK]) == i) {
+            atomic_store(&check.block_owner[node->blocks[b] - FIRST_DATA_BLOCK], -1);
+          }
+          node->blocks[b] = -1;
+        }
+        for (int32_t b = count; b < expected; b++) {
+          node->blocks[b] = HOLE_BLOCK;
+        }
+      }
+    }
+  }
+  problems += inode_problems + atomic_load(&check.num_range);
+
+  // blocks claimed by a second file; repair gives the loser its own copy later
+  int num_double = atomic_load(&check.num_double);
+  for (int d = 0; d < num_double; d++) {
+    int32_t inode_index = check.double_blocks[2 * d];
+    int32_t slot = check.double_blocks[2 * d + 1];
+    int32_t block_index = inodes[inode_index].blocks[slot];
+    if (reported++ < FSCK_REPORT_LIMIT) {
+      printf("fsck: block %d is used by both %s and %s\n", block_index,
+             directory[check.owner_entry[atomic_load(&check.block_owner[block_index - FIRST_DATA_BLOCK])]].filename,
+             directory[check.owner_entry[inode_index]].filename);
+    }
+  }
+  problems += num_double;
+
+  // free block map: a block is used when a live file or a snapshot refers to it
+  int leaked = 0;
+  int lost = 0;
+  for (int b = 0; b < NUM_DATA_BLOCKS; b++) {
+    int used = atomic_load(&check.block_owner[b]) != -1 || block_refs[b] > 0;
+    if (used && free_blocks[b]) {
+      lost++;
+    }
+    else if (!used && !free_blocks[b]) {
+      leaked++;
+    }
+    if (repair) {
+      free_blocks[b] = !used;
+    }
+  }
+  if (lost > 0) {
+    printf("fsck: %d blocks in use are marked free%s\n", lost, repair ? ", marked used" : "");
+  }
+  if (leaked > 0) {
+    printf("fsck: %d blocks are allocated but unused%s\n", leaked, repair ? ", freed" : "");
+  }
+  problems += lost + leaked;
+
+  if (repair) {
+    for (int d = 0; d < num_double; d++) {
+      int32_t inode_index = check.double_blocks[2 * d];
+      int32_t slot = check.double_blocks[2 * d + 1];
+      int32_t copy = findFreeBlock();
+      if (copy == -1) {
+        printf("fsck: No free block to separate %s, made a hole\n", directory[check.owner_entry[inode_index]].filename);
+        inodes[inode_index].blocks[slot] = HOLE_BLOCK;
+        continue;
+      }
+      free_blocks[copy - FIRST_DATA_BLOCK] = 0;
+      memcpy(data[copy], data[inodes[inode_index].blocks[slot]], BLOCK_SIZE);
+      touchBlock(copy);
+      inodes[inode_index].blocks[slot] = copy;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+  if (reported > FSCK_REPORT_LIMIT) {
+    printf("fsck: %d more problems not shown\n", reported - FSCK_REPORT_LIMIT);
+  }
+  printf("fsck: %d problems %s in %.2f ms (%d threads)\n", problems, repair ? "repaired" : "found", ms, started > 0 ? started : 1);
+  free(check.block_owner);
+  free(check.double_blocks);
+  return problems;
+}
+
+// Select the engine used for image and file transfers. The change takes effect on the
+// next transfer.
+void ioenginefs(char * kind, char * depth){
+  if (kind != NULL) {
+    if (strcmp(kind, "sync") == 0) {
+      io_engine_kind = IO_SYNC;
+    }
+    else if (strcmp(kind, "uring") == 0) {
+      io_engine_kind = IO_URING;
+    }
+    else {
+      printf("ioengine: Unknown engine %s\n", kind);
+      return;
+    }
+    if (depth != NULL && atoi(depth) > 0) {
+      io_engine_depth = atoi(depth) > IO_MAX_DEPTH ? IO_MAX_DEPTH : atoi(depth);
+    }
+    if (io_engine_ready) {
+      ioEngineDestroy(&io_engine);
+      io_engine_ready = 0;
+    }
+  }
+  struct _ioEngine * engine = ioEngine();
+  printf("ioengine: %s, queue depth %d%s\n", engine->kind == IO_URING ? "uring" : "sync", engine->depth,
+         engine->registered != NULL ? ", image registered" : "");
+}
+
+// Move a copy of the whole image to a scratch file and back in 4 KiB requests issued in
+// random order, once with the sync engine and once per io_uring queue depth. The copy
+// keeps a failed or partial read from landing in the open image.
+#define BENCH_REQUEST_BLOCKS 4
+
+double benchioPass(struct _ioEngine * engine, int op, int fd, uint8_t * buffer, int32_t * order, int count){
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < count; i++) {
+    int32_t block = order[i] * BENCH_REQUEST_BLOCKS;
+    ioQueue(engine, op, fd, buffer + (size_t) block * BLOCK_SIZE, BENCH_REQUEST_BLOCKS * BLOCK_SIZE,
+            (off_t) block * BLOCK_SIZE);
+  }
+  long bytes = ioDrain(engine);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  if (bytes != (long) count * BENCH_REQUEST_BLOCKS * BLOCK_SIZE || seconds <= 0) {
+    return -1;
+  }
+  return bytes / seconds / 1e6;
+}
+
+void benchiofs(char * scratch, int direct){
+  int count = NUM_BLOCKS / BENCH_REQUEST_BLOCKS;
+  int32_t * order = (int32_t *) malloc(count * sizeof(int32_t));
+  for (int i = 0; i < count; i++) {
+    order[i] = i;
+  }
+  unsigned int seed = 12345;
+  for (int i = count - 1; i > 0; i--) {
+    int j = rand_r(&seed) % (i + 1);
+    int32_t tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+  uint8_t * buffer = NULL;
+  if (posix_memalign((void **) &buffer, 4096, (size_t) NUM_BLOCKS * BLOCK_SIZE) != 0) {
+    printf("benchio: Out of memory\n");
+    free(order);
+    return;
+  }
+  memcpy(buffer, &data[0][0], (size_t) NUM_BLOCKS * BLOCK_SIZE);
+  int fd = open(scratch, O_RDWR | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0), 0644);
+  if (fd == -1) {
+    printf("benchio: %s: %s\n", scratch, strerror(errno));
+    free(buffer);
+    free(order);
+    return;
+  }
+  int depths[] = { 1, 2, 4, 8, 16, 32, 64, 128, 0 };
+  printf("%-6s %6s %12s %12s\n", "engine", "depth", "write MB/s", "read MB/s");
+  for (int kind = IO_SYNC; kind <= IO_URING; kind++) {
+    for (int d = 0; depths[d] != 0; d++) {
+      // the sync engine only ever has one request in flight
+      if (kind == IO_SYNC && d > 0) {
+        break;
+      }
+      struct _ioEngine engine;
+      if (ioEngineInit(&engine, kind, depths[d]) == -1) {
+        printf("%-6s unavailable: %s\n", "uring", strerror(errno));
+        break;
+      }
+      uringRegister(&engine, buffer, (size_t) NUM_BLOCKS * BLOCK_SIZE);
+      double write_rate = benchioPass(&engine, IO_WRITE, fd, buffer, order, count);
+      double read_rate = write_rate < 0 ? -1 : benchioPass(&engine, IO_READ, fd, buffer, order, count);
+      printf("%-6s %6d %12.1f %12.1f\n", kind == IO_URING ? "uring" : "sync", depths[d], write_rate, read_rate);
+      ioEngineDestroy(&engine);
+      if (write_rate < 0 || read_rate < 0) {
+        printf("benchio: transfer failed\n");
+        kind = IO_URING + 1;
+        break;
+      }
+    }
+  }
+  close(fd);
+  unlink(scratch);
+  free(buffer);
+  free(order);
+}
+
+// Snapshots. A snapshot is a copy of the metadata region (directory, free inode map
+// and inode table) taken at one point in time; the data blocks it names are shared
+// with the live file system and pinned through block_refs. Taking one therefore
+// costs METADATA_BLOCKS blocks of memory no matter how much data the image holds.
+// Snapshots are kept in <image>.snaps next to the image, written by savefs.
+struct _snapshot {
+  char name[64];
+  int64_t taken;
+  uint8_t * metadata;
+};
+
+struct _snapshot snapshots[MAX_SNAPSHOTS];
+int num_snapshots = 0;
+int snapshots_changed = 0; // the snapshot file no longer matches snapshots[]
+
+struct inode * snapshotInodes(struct _snapshot * snapshot){
+  return (struct inode *) (snapshot->metadata + FIRST_INODE_BLOCK * BLOCK_SIZE);
+}
+
+struct _directoryEntry * snapshotDirectory(struct _snapshot * snapshot){
+  return (struct _directoryEntry *) snapshot->metadata;
+}
+
+// Add delta to the reference count of every data block a snapshot points at.
+void snapshotReference(struct _snapshot * snapshot, int delta){
+  struct _directoryEntry * snap_directory = snapshotDirectory(snapshot);
+  struct inode * snap_inodes = snapshotInodes(snapshot);
+  for (int i = 0; i < NUM_FILES; i++) {
+    if (!snap_directory[i].in_use) {
+      continue;
+    }
+    struct inode * node = &snap_inodes[snap_directory[i].inode];
+    for (int b = 0; b < BLOCKS_PER_FILE && node->blocks[b] != -1 && !(node->attribute & INLINE); b++) {
+      if (node->blocks[b] != HOLE_BLOCK) {
+        block_refs[node->blocks[b] - FIRST_DATA_BLOCK] += delta;
+      }
+    }
+  }
+}
+
+// Rebuild the free block map: a data block is in use when a live file or a snapshot
+// points at it.
+// Mark the data blocks of every file of a directory and its inode table in use in map.
+void holdFileBlocks(uint8_t * map, struct _directoryEntry * dir, struct inode * table){
+  for (int i = 0; i < NUM_FILES; i++) {
+    if (!dir[i].in_use) {
+      continue;
+    }
+    struct inode * node = &table[dir[i].inode];
+    for (int b = 0; b < BLOCKS_PER_FILE && node->blocks[b] != -1 && !(node->attribute & INLINE); b++) {
+      if (node->blocks[b] != HOLE_BLOCK) {
+        map[node->blocks[b] - FIRST_DATA_BLOCK] = 0;
+      }
+    }
+  }
+}
+
+void rebuildFreeBlocks(){
+  for (int b = 0; b < NUM_DATA_BLOCKS; b++) {
+    free_blocks[b] = block_refs[b] == 0;
+  }
+  holdFileBlocks(free_blocks, directory, inodes);
+}
+
+int pinned_files = 0; // pins taken by pinFile and not yet let go of, on any image
+
+// Pins do not outlive the process, so the image file must not keep a block that only a
+// pinned reader holds: it would come back in use with no owner. Put the free block map
+// without pins in free_blocks, marking the map blocks that change dirty, and return the
+// live map for pinsRestore. Returns NULL when nothing is pinned. Called with image_mutex held.
+uint8_t * pinsHide(){
+  if (pinned_files == 0) {
+    return NULL;
+  }
+  uint8_t * live_free = (uint8_t *) malloc(NUM_DATA_BLOCKS);
+  memcpy(live_free, free_blocks, NUM_DATA_BLOCKS);
+  memset(free_blocks, 1, NUM_DATA_BLOCKS);
+  holdFileBlocks(free_blocks, directory, inodes);
+  for (int i = 0; i < num_snapshots; i++) {
+    holdFileBlocks(free_blocks, snapshotDirectory(&snapshots[i]), snapshotInodes(&snapshots[i]));
+  }
+  for (int b = 0; b < NUM_DATA_BLOCKS; b++) {
+    if (free_blocks[b] != live_free[b]) {
+      markDirty(FREE_BLOCK_MAP + b / BLOCK_SIZE);
+    }
+  }
+  return live_free;
+}
+
+void pinsRestore(uint8_t * live_free){
+  if (live_free != NULL) {
+    memcpy(free_blocks, live_free, NUM_DATA_BLOCKS);
+    free(live_free);
+  }
+}
+
+int findSnapshot(char * name){
+  for (int i = 0; i < num_snapshots; i++) {
+    if (strcmp(snapshots[i].name, name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void dropSnapshots(){
+  for (int i = 0; i < num_snapshots; i++) {
+    free(snapshots[i].metadata);
+  }
+  num_snapshots = 0;
+  memset(block_refs, 0, sizeof(block_refs));
+  snapshots_changed = 1;
+}
+
+void snapshotfs(char * name){
+  if (strlen(name) >= 64) {
+    printf("snapshot: Name too long\n");
+    return;
+  }
+  if (findSnapshot(name) != -1) {
+    printf("snapshot: %s already exists\n", name);
+    return;
+  }
+  if (num_snapshots == MAX_SNAPSHOTS) {
+    printf("snapshot: Limit of %d snapshots reached\n", MAX_SNAPSHOTS);
+    return;
+  }
+  struct _snapshot * snapshot = &snapshots[num_snapshots];
+  snapshot->metadata = (uint8_t *) malloc(METADATA_BLOCKS * BLOCK_SIZE);
+  if (snapshot->metadata == NULL) {
+    printf("snapshot: Out of memory\n");
+    return;
+  }
+  memcpy(snapshot->metadata, &data[0][0], METADATA_BLOCKS * BLOCK_SIZE);
+  memset(snapshot->name, 0, 64);
+  strcpy(snapshot->name, name);
+  snapshot->taken = time(NULL);
+  snapshotReference(snapshot, 1);
+  num_snapshots++;
+  snapshots_changed = 1;
+  printf("Snapshot %s taken\n", name);
+}
+
+void snapshotsfs(){
+  if (num_snapshots == 0) {
+    printf("snapshots: No snapshots\n");
+    return;
+  }
+  for (int i = 0; i < num_snapshots; i++) {
+    struct _directoryEntry * snap_directory = snapshotDirectory(&snapshots[i]);
+    struct inode * snap_inodes = snapshotInodes(&snapshots[i]);
+    int files = 0;
+    long bytes = 0;
+    for (int f = 0; f < NUM_FILES; f++) {
+      if (snap_directory[f].in_use) {
+        files++;
+        bytes += snap_inodes[snap_directory[f].inode].file_size;
+      }
+    }
+    char when[32];
+    time_t taken = (time_t) snapshots[i].taken;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&taken));
+    printf("%-20s %s %4d files %10ld bytes\n", snapshots[i].name, when, files, bytes);
+  }
+}
+
+// Put the live file system back to the state of a snapshot. The snapshot is kept.
+void rollbackfs(char * name){
+  int index = findSnapshot(name);
+  if (index == -1) {
+    printf("rollback: %s not found\n", name);
+    return;
+  }
+  memcpy(&data[0][0], snapshots[index].metadata, METADATA_BLOCKS * BLOCK_SIZE);
+  rebuildFreeBlocks();
+  printf("Rolled back to %s\n", name);
+}
+
+void snapdelfs(char * name){
+  int index = findSnapshot(name);
+  if (index == -1) {
+    printf("snapdel: %s not found\n", name);
+    return;
+  }
+  snapshotReference(&snapshots[index], -1);
+  free(snapshots[index].metadata);
+  for (int i = index; i < num_snapshots - 1; i++) {
+    snapshots[i] = snapshots[i + 1];
+  }
+  num_snapshots--;
+  snapshots_changed = 1;
+  rebuildFreeBlocks();
+}
+
+// Compare a snapshot against the live file system, or two snapshots with each other.
+// + added, - removed, M contents or size changed, A attributes changed.
+void snapdifffs(char * from, char * to){
+  int from_index = findSnapshot(from);
+  int to_index = to == NULL ? -1 : findSnapshot(to);
+  if (from_index == -1 || (to != NULL && to_index == -1)) {
+    printf("snapdiff: %s not found\n", from_index == -1 ? from : to);
+    return;
+  }
+  struct _directoryEntry * old_directory = snapshotDirectory(&snapshots[from_index]);
+  struct inode * old_inodes = snapshotInodes(&snapshots[from_index]);
+  struct _directoryEntry * new_directory = to == NULL ? directory : snapshotDirectory(&snapshots[to_index]);
+  struct inode * new_inodes = to == NULL ? inodes : snapshotInodes(&snapshots[to_index]);
+  int changes = 0;
+  for (int i = 0; i < NUM_FILES; i++) {
+    if (!old_directory[i].in_use) {
+      continue;
+    }
+    int found = -1;
+    for (int j = 0; j < NUM_FILES && found == -1; j++) {
+      if (new_directory[j].in_use && strcmp(new_directory[j].filename, old_directory[i].filename) == 0) {
+        found = j;
+      }
+    }
+    if (found == -1) {
+      printf("- %s\n", old_directory[i].filename);
+      changes++;
+      continue;
+    }
+    struct inode * old_node = &old_inodes[old_directory[i].inode];
+    struct inode * new_node = &new_inodes[new_directory[found].inode];
+    if (old_node->file_size != new_node->file_size ||
+        memcmp(old_node->blocks, new_node->blocks, sizeof(old_node->blocks)) != 0) {
+      printf("M %s\n", old_directory[i].filename);
+      changes++;
+    }
+    else if (old_node->attribute != new_node->attribute) {
+      printf("A %s\n", old_directory[i].filename);
+      changes++;
+    }
+  }
+  for (int j = 0; j < NUM_FILES; j++) {
+    if (!new_directory[j].in_use) {
+      continue;
+    }
+    int found = 0;
+    for (int i = 0; i < NUM_FILES && !found; i++) {
+      found = old_directory[i].in_use && strcmp(old_directory[i].filename, new_directory[j].filename) == 0;
+    }
+    if (!found) {
+      printf("+ %s\n", new_directory[j].filename);
+      changes++;
+    }
+  }
+  if (changes == 0) {
+    printf("snapdiff: No differences\n");
+  }
+}
+
+#define SNAPSHOT_MAGIC "MFSSNAP1"
+
+void writeSnapshots(char * image, struct _snapshot * list, int count){
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s.snaps", image);
+  if (count == 0) {
+    unlink(path);
+    return;
+  }
+  FILE * fp = fopen(path, "w");
+  if (fp == NULL) {
+    perror("savefs: snapshots");
+    return;
+  }
+  int32_t stored = count;
+  fwrite(SNAPSHOT_MAGIC, 8, 1, fp);
+  fwrite(&stored, sizeof(stored), 1, fp);
+  for (int i = 0; i < count; i++) {
+    fwrite(list[i].name, 64, 1, fp);
+    fwrite(&list[i].taken, sizeof(int64_t), 1, fp);
+    fwrite(list[i].metadata, BLOCK_SIZE, METADATA_BLOCKS, fp);
+  }
+  if (fclose(fp) != 0) {
+    perror("savefs: snapshots");
+  }
+}
+
+void saveSnapshots(){
+  writeSnapshots(image_name, snapshots, num_snapshots);
+}
+
+void loadSnapshots(){
+  dropSnapshots();
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s.snaps", image_name);
+  FILE * fp = fopen(path, "r");
+  if (fp == NULL) {
+    return;
+  }
+  char magic[8];
+  int32_t count = 0;
+  if (fread(magic, 8, 1, fp) != 1 || memcmp(magic, SNAPSHOT_MAGIC, 8) != 0 ||
+      fread(&count, sizeof(count), 1, fp) != 1 || count < 0 || count > MAX_SNAPSHOTS) {
+    printf("open: %s is not a snapshot file\n", path);
+    fclose(fp);
+    return;
+  }
+  for (int i = 0; i < count; i++) {
+    struct _snapshot * snapshot = &snapshots[num_snapshots];
+    snapshot->metadata = (uint8_t *) malloc(METADATA_BLOCKS * BLOCK_SIZE);
+    if (fread(snapshot->name, 64, 1, fp) != 1 || fread(&snapshot->taken, sizeof(int64_t), 1, fp) != 1 ||
+        fread(snapshot->metadata, BLOCK_SIZE, METADATA_BLOCKS, fp) != METADATA_BLOCKS) {
+      printf("open: %s is truncated\n", path);
+      free(snapshot->metadata);
+      break;
+    }
+    snapshot->name[63] = '\0';
+    snapshotReference(snapshot, 1);
+    num_snapshots++;
+  }
+  fclose(fp);
+  snapshots_changed = 0;
+}
+
+// Block deltas. delta-export writes every block stamped after a given generation:
+// changed metadata blocks and changed data blocks that are still allocated. delta-apply
+// copies them into another image that is at that generation or later, bringing it to
+// the generation of the delta. Generation 0 exports the whole image.
+//
+// Stream: "MFSDELTA", since, generation, count (uint32 each), then count records of
+// block number, generation and BLOCK_SIZE bytes, then an FNV-1a hash of the records.
+#define DELTA_MAGIC "MFSDELTA"
+
+struct _deltaRecord {
+  uint32_t block;
+  uint32_t generation;
+};
+
+uint64_t fnv1a(uint64_t hash, const void * buf, size_t len){
+  const uint8_t * bytes = (const uint8_t *) buf;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+int deltaWanted(int32_t block_index, uint32_t since){
+  if (block_gen[block_index] <= since) {
+    return 0;
+  }
+  // the contents of a free data block do not matter to the other side
+  return block_index < FIRST_DATA_BLOCK || !free_blocks[block_index - FIRST_DATA_BLOCK];
+}
+
+void deltaexportfs(uint32_t since, char * target){
+  int fd = strcmp(target, "-") == 0 ? STDOUT_FILENO : open(target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    fprintf(stderr, "delta-export: %s: %s\n", target, strerror(errno));
+    return;
+  }
+  uint32_t count = 0;
+  for (int32_t b = 0; b < NUM_BLOCKS; b++) {
+    count += deltaWanted(b, since);
+  }
+  uint32_t header[3] = { since, generation, count };
+  int failed = writeFull(fd, DELTA_MAGIC, 8) == -1 || writeFull(fd, header, sizeof(header)) == -1;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  uint8_t * buffer = (uint8_t *) malloc(TAR_BUFFER_SIZE);
+  size_t record_size = sizeof(struct _deltaRecord) + BLOCK_SIZE;
+  size_t used = 0;
+  for (int32_t b = 0; b < NUM_BLOCKS && !failed; b++) {
+    if (!deltaWanted(b, since)) {
+      continue;
+    }
+    if (used + record_size > TAR_BUFFER_SIZE) {
+      failed = writeFull(fd, buffer, used) == -1;
+      used = 0;
+    }
+    struct _deltaRecord record = { (uint32_t) b, block_gen[b] };
+    memcpy(buffer + used, &record, sizeof(record));
+    memcpy(buffer + used + sizeof(record), data[b], BLOCK_SIZE);
+    hash = fnv1a(hash, buffer + used, record_size);
+    used += record_size;
+  }
+  if (!failed) {
+    memcpy(buffer + used, &hash, sizeof(hash));
+    used += sizeof(hash);
+    failed = writeFull(fd, buffer, used) == -1;
+  }
+  if (failed) {
+    fprintf(stderr, "delta-export: %s\n", strerror(errno));
+  }
+  else {
+    fprintf(stderr, "Delta from generation %u to %u: %u blocks, %lu bytes\n", since, generation, count,
+            (unsigned long) (8 + sizeof(header) + (size_t) count * record_size + sizeof(hash)));
+  }
+  free(buffer);
+  if (fd != STDOUT_FILENO) {
+    close(fd);
+  }
+}
+
+void deltaapplyfs(char * source){
+  if (num_snapshots > 0) {
+    printf("delta-apply: Delete the snapshots of this image first\n");
+    return;
+  }
+  int fd = strcmp(source, "-") == 0 ? STDIN_FILENO : open(source, O_RDONLY);
+  if (fd == -1) {
+    printf("delta-apply: %s: %s\n", source, strerror(errno));
+    return;
+  }
+  char magic[8];
+  uint32_t header[3];
+  if (readFull(fd, magic, 8) != 8 || memcmp(magic, DELTA_MAGIC, 8) != 0 ||
+      readFull(fd, header, sizeof(header)) != sizeof(header)) {
+    printf("delta-apply: %s is not a delta\n", source);
+    if (fd != STDIN_FILENO) {
+      close(fd);
+    }
+    return;
+  }
+  uint32_t since = header[0];
+  uint32_t delta_generation = header[1];
+  uint32_t count = header[2];
+  if (since > 0 && generation < since) {
+    printf("delta-apply: Delta starts at generation %u but the image is at %u\n", since, generation);
+    if (fd != STDIN_FILENO) {
+      close(fd);
+    }
+    return;
+  }
+  // read everything before touching the image so a bad delta changes nothing
+  size_t record_size = sizeof(struct _deltaRecord) + BLOCK_SIZE;
+  uint8_t * records = (uint8_t *) malloc((size_t) count * record_size + 1);
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  uint64_t expected;
+  int ok = records != NULL && readFull(fd, records, (size_t) count * record_size) == (ssize_t) (count * record_size) &&
+           readFull(fd, &expected, sizeof(expected)) == sizeof(expected);
+  if (ok) {
+    hash = fnv1a(hash, records, (size_t) count * record_size);
+    ok = hash == expected;
+  }
+  for (uint32_t i = 0; i < count && ok; i++) {
+    struct _deltaRecord * record = (struct _deltaRecord *) (records + i * record_size);
+    ok = record->block < NUM_BLOCKS;
+  }
+  if (!ok) {
+    printf("delta-apply: %s is truncated or corrupt\n", source);
+  }
+  else {
+    for (uint32_t i = 0; i < count; i++) {
+      struct _deltaRecord * record = (struct _deltaRecord *) (records + i * record_size);
+      memcpy(data[record->block], records + i * record_size + sizeof(struct _deltaRecord), BLOCK_SIZE);
+      block_gen[record->block] = record->generation;
+      markDirty(record->block);
+    }
+    if (delta_generation > generation) {
+      generation = delta_generation;
+    }
+    resetGeneration();
+    printf("Applied %u blocks, image is at generation %u\n", count, generation);
+  }
+  free(records);
+  if (fd != STDIN_FILENO) {
+    close(fd);
+  }
+}
+
+#define GENERATION_MAGIC "MFSGEN01"
+
+void writeGenerations(char * image, uint32_t last, uint32_t * stamps){
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s.gen", image);
+  FILE * fp = fopen(path, "w");
+  if (fp == NULL) {
+    perror("savefs: generations");
+    return;
+  }
+  fwrite(GENERATION_MAGIC, 8, 1, fp);
+  fwrite(&last, sizeof(last), 1, fp);
+  fwrite(stamps, sizeof(block_gen), 1, fp);
+  if (fclose(fp) != 0) {
+    perror("savefs: generations");
+  }
+}
+
+void saveGenerations(){
+  writeGenerations(image_name, generation, block_gen);
+}
+
+// Without a .gen file every block counts as written in generation 1.
+void loadGenerations(){
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s.gen", image_name);
+  FILE * fp = fopen(path, "r");
+  char magic[8];
+  if (fp == NULL || fread(magic, 8, 1, fp) != 1 || memcmp(magic, GENERATION_MAGIC, 8) != 0 ||
+      fread(&generation, sizeof(generation), 1, fp) != 1 || fread(block_gen, sizeof(block_gen), 1, fp) != 1) {
+    generation = 1;
+    for (int b = 0; b < NUM_BLOCKS; b++) {
+      block_gen[b] = 1;
+    }
+  }
+  if (fp != NULL) {
+    fclose(fp);
+  }
+  // a read-only image never changes, so it needs no shadow to compare against
+  if (!image_read_only) {
+    resetGeneration();
+  }
+}
+
+// Compact images. savefs --compact writes a container that holds only what is allocated:
+// a header block, the metadata blocks (directory, free inode map, inode table and free
+// block map), a bitmap of the data blocks stored, those blocks packed in block order and
+// an index of their block numbers. open recognises it by its magic, which no directory
+// entry can start with, and reads only the bytes it holds; savefs keeps the format the
+// image was opened in and savefs --flat writes a plain image again.
+#define COMPACT_MAGIC "\x89MFSCMP\n"
+#define COMPACT_BITMAP_SIZE (((NUM_DATA_BLOCKS + 7) / 8 + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE)
+
+struct _compactHeader {
+  char magic[8];
+  uint32_t block_size;
+  uint32_t num_blocks;
+  uint32_t metadata_blocks; // stored whole, right after the header block
+  uint32_t data_blocks;     // packed after the bitmap
+  uint64_t bitmap_offset;
+  uint64_t data_offset;
+  uint64_t index_offset;    // data_blocks int32_t block numbers, ascending
+};
+
+int isCompact(int fd){
+  char magic[8];
+  return pread(fd, magic, 8, 0) == 8 && memcmp(magic, COMPACT_MAGIC, 8) == 0;
+}
+
+// Write a compact image. indexes lists count blocks in ascending order, starting with
+// every metadata block, and blocks[i] holds the contents of block indexes[i]. Returns 0,
+// or -1 with errno set.
+int compactWrite(struct _ioEngine * engine, int fd, int32_t count, int32_t * indexes, uint8_t ** blocks){
+  struct _compactHeader * header = (struct _compactHeader *) calloc(1, BLOCK_SIZE);
+  uint8_t * bitmap = (uint8_t *) calloc(1, COMPACT_BITMAP_SIZE);
+  int32_t data_blocks = count - FIRST_DATA_BLOCK;
+  int32_t * index = (int32_t *) malloc((data_blocks + 1) * sizeof(int32_t));
+  for (int32_t i = 0; i < data_blocks; i++) {
+    int32_t b = indexes[FIRST_DATA_BLOCK + i] - FIRST_DATA_BLOCK;
+    bitmap[b / 8] |= 1 << (b % 8);
+    index[i] = indexes[FIRST_DATA_BLOCK + i];
+  }
+  memcpy(header->magic, COMPACT_MAGIC, 8);
+  header->block_size = BLOCK_SIZE;
+  header->num_blocks = NUM_BLOCKS;
+  header->metadata_blocks = FIRST_DATA_BLOCK;
+  header->data_blocks = data_blocks;
+  header->bitmap_offset = (uint64_t) (1 + FIRST_DATA_BLOCK) * BLOCK_SIZE;
+  header->data_offset = header->bitmap_offset + COMPACT_BITMAP_SIZE;
+  header->index_offset = header->data_offset + (uint64_t) data_blocks * BLOCK_SIZE;
+  ioQueue(engine, IO_WRITE, fd, (uint8_t *) header, BLOCK_SIZE, 0);
+  ioQueue(engine, IO_WRITE, fd, bitmap, COMPACT_BITMAP_SIZE, header->bitmap_offset);
+  if (data_blocks > 0) {
+    ioQueue(engine, IO_WRITE, fd, (uint8_t *) index, data_blocks * sizeof(int32_t), header->index_offset);
+  }
+  // metadata block i goes to block i + 1 of the file, data block i to slot i of the packed area
+  for (int32_t i = 0; i < count; ) {
+    int32_t run = 1;
+    while (run < IO_CHUNK_BLOCKS && i + run < count && i + run != FIRST_DATA_BLOCK &&
+           blocks[i + run] == blocks[i] + run * BLOCK_SIZE) {
+      run++;
+    }
+    off_t offset = i < FIRST_DATA_BLOCK ? (off_t) (1 + i) * BLOCK_SIZE
+                                        : (off_t) header->data_offset + (off_t) (i - FIRST_DATA_BLOCK) * BLOCK_SIZE;
+    ioQueue(engine, IO_WRITE, fd, blocks[i], run * BLOCK_SIZE, offset);
+    i += run;
+  }
+  int result = ioDrain(engine);
+  if (result != -1 && ftruncate(fd, header->index_offset + data_blocks * sizeof(int32_t)) == -1) {
+    result = -1;
+  }
+  free(header);
+  free(bitmap);
+  free(index);
+  return result == -1 ? -1 : 0;
+}
+
+// Read a compact image into data. Returns 0, or -1 when the file is not a sound one.
+int compactRead(struct _ioEngine * engine, int fd){
+  struct _compactHeader header;
+  struct stat buf;
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || fstat(fd, &buf) == -1 ||
+      memcmp(header.magic, COMPACT_MAGIC, 8) != 0 || header.block_size != BLOCK_SIZE ||
+      header.num_blocks != NUM_BLOCKS || header.metadata_blocks != FIRST_DATA_BLOCK ||
+      header.data_blocks > NUM_DATA_BLOCKS ||
+      header.index_offset != header.data_offset + (uint64_t) header.data_blocks * BLOCK_SIZE ||
+      (uint64_t) buf.st_size < header.index_offset + header.data_blocks * sizeof(int32_t)) {
+    return -1;
+  }
+  uint8_t * bitmap = (uint8_t *) malloc(COMPACT_BITMAP_SIZE);
+  int32_t * index = (int32_t *) malloc((header.data_blocks + 1) * sizeof(int32_t));
+  int result = 0;
+  if (pread(fd, bitmap, COMPACT_BITMAP_SIZE, header.bitmap_offset) != COMPACT_BITMAP_SIZE ||
+      (header.data_blocks > 0 && pread(fd, index, header.data_blocks * sizeof(int32_t), header.index_offset) !=
+       (ssize_t) (header.data_blocks * sizeof(int32_t)))) {
+    result = -1;
+  }
+  // the index must be ascending and agree with the bitmap
+  for (uint32_t i = 0; i < header.data_blocks && result == 0; i++) {
+    int32_t b = index[i] - FIRST_DATA_BLOCK;
+    if (b < 0 || b >= NUM_DATA_BLOCKS || (i > 0 && index[i] <= index[i - 1]) || !(bitmap[b / 8] & (1 << (b % 8)))) {
+      result = -1;
+    }
+  }
+  if (result == 0) {
+    for (int32_t i = 0; i < FIRST_DATA_BLOCK; i += IO_CHUNK_BLOCKS) {
+      int32_t run = FIRST_DATA_BLOCK - i < IO_CHUNK_BLOCKS ? FIRST_DATA_BLOCK - i : IO_CHUNK_BLOCKS;
+      ioQueue(engine, IO_READ, fd, data[i], run * BLOCK_SIZE, (off_t) (1 + i) * BLOCK_SIZE);
+    }
+    // what is not stored reads as zeros
+    memset(data[FIRST_DATA_BLOCK], 0, (size_t) NUM_DATA_BLOCKS * BLOCK_SIZE);
+    for (uint32_t i = 0; i < header.data_blocks; ) {
+      uint32_t run = 1;
+      while (run < IO_CHUNK_BLOCKS && i + run < header.data_blocks && index[i + run] == index[i] + (int32_t) run) {
+        run++;
+      }
+      ioQueue(engine, IO_READ, fd, data[index[i]], run * BLOCK_SIZE, (off_t) (header.data_offset + (uint64_t) i * BLOCK_SIZE));
+      i += run;
+    }
+    result = ioDrain(engine) == -1 ? -1 : 0;
+  }
+  free(bitmap);
+  free(index);
+  return result;
+}
+
+// Background autosave. autosave <seconds> [<max dirty KiB>] starts a checkpoint thread
+// that writes the image whenever the interval has passed or more than the given amount
+// of it has changed. A checkpoint is taken between commands: the blocks marked in
+// block_dirty are copied, by the prompt loop after a command or by the thread while the
+// prompt waits for input (commands run holding image_mutex). The thread then writes the
+// copies without the mutex into <image>.ckpt, which starts as a copy of the image file
+// made with copy_file_range, and renames that over the image, so commands only ever wait
+// for the copy. savefs waits for a checkpoint in flight; open, close, createfs and quit
+// also write a last one. Compact images are not checkpointed: autosave refuses them.
+#define AUTOSAVE_INTERVAL 30    // default seconds between checkpoints
+#define AUTOSAVE_MAX_DIRTY 8192 // default KiB changed that starts a checkpoint early
+
+pthread_cond_t autosave_wake = PTHREAD_COND_INITIALIZER; // stop, or a checkpoint was taken
+pthread_cond_t autosave_done = PTHREAD_COND_INITIALIZER; // a checkpoint finished
+pthread_t autosave_thread;
+int autosave_enabled = 0;
+int autosave_interval = AUTOSAVE_INTERVAL;
+int64_t autosave_max_dirty = (int64_t) AUTOSAVE_MAX_DIRTY * 1024;
+struct _checkpoint * checkpoint_pending = NULL; // taken, for the thread to write
+int checkpoint_running = 0;
+int num_checkpoints = 0;
+double last_checkpoint_ms = 0;
+struct timespec checkpoint_deadline; // CLOCK_REALTIME, when the next checkpoint is due
+
+void autosaveRearm(){
+  clock_gettime(CLOCK_REALTIME, &checkpoint_deadline);
+  checkpoint_deadline.tv_sec += autosave_interval;
+}
+
+struct _checkpoint {
+  char image[64];
+  int base;                    // the image file holds every block that was not copied
+  int32_t count;
+  int32_t * indexes;
+  uint8_t * blocks;
+  uint32_t generation;
+  uint32_t * block_gen;
+  uint8_t * free_map;          // free_blocks, punched out of the file
+  int num_snapshots;           // -1 when the snapshot file is up to date
+  struct _snapshot * snapshots;
+};
+
+void checkpointFree(struct _checkpoint * checkpoint){
+  for (int i = 0; i < checkpoint->num_snapshots; i++) {
+    free(checkpoint->snapshots[i].metadata);
+  }
+  free(checkpoint->snapshots);
+  free(checkpoint->indexes);
+  free(checkpoint->blocks);
+  free(checkpoint->block_gen);
+  free(checkpoint->free_map);
+  free(checkpoint);
+}
+
+// Copy the blocks changed since the image file was written. Called with image_mutex held.
+// Only flat images are checkpointed (autosaveDue): one is patched in place, so the copy
+// is the dirty blocks alone. A compact image would need every block in use copied under
+// the mutex, up to 64 MiB, and is left to savefs. Returns NULL, with the blocks still
+// dirty, when there is not enough memory for the copy.
+struct _checkpoint * checkpointTake(){
+  uint8_t * live_free = pinsHide();
+  int32_t wanted = 0;
+  for (int32_t b = 0; b < NUM_BLOCKS; b++) {
+    // a free block is punched, not written
+    wanted += block_dirty[b] && blockInUse(b);
+  }
+  struct _checkpoint * checkpoint = (struct _checkpoint *) calloc(1, sizeof(struct _checkpoint));
+  if (checkpoint != NULL) {
+    checkpoint->indexes = (int32_t *) malloc((wanted + 1) * sizeof(int32_t));
+    checkpoint->blocks = (uint8_t *) malloc((size_t) (wanted + 1) * BLOCK_SIZE);
+    checkpoint->free_map = (uint8_t *) malloc(NUM_DATA_BLOCKS);
+    checkpoint->block_gen = (uint32_t *) malloc(sizeof(block_gen));
+  }
+  if (checkpoint == NULL || checkpoint->indexes == NULL || checkpoint->blocks == NULL ||
+      checkpoint->free_map == NULL || checkpoint->block_gen == NULL) {
+    printf("autosave: Not enough memory for a checkpoint of %s\n", image_name);
+    if (checkpoint != NULL) {
+      checkpointFree(checkpoint);
+    }
+    pinsRestore(live_free);
+    return NULL;
+  }
+  snprintf(checkpoint->image, sizeof(checkpoint->image), "%s", image_name);
+  checkpoint->base = dirty_blocks < NUM_BLOCKS;
+  for (int32_t b = 0; b < NUM_BLOCKS; b++) {
+    if (block_dirty[b] && blockInUse(b)) {
+      checkpoint->indexes[checkpoint->count] = b;
+      memcpy(checkpoint->blocks + (size_t) checkpoint->count * BLOCK_SIZE, data[b], BLOCK_SIZE);
+      checkpoint->count++;
+    }
+  }
+  memset(block_dirty, 0, sizeof(block_dirty));
+  dirty_blocks = 0;
+  memcpy(checkpoint->free_map, free_blocks, NUM_DATA_BLOCKS);
+  checkpoint->generation = generation;
+  memcpy(checkpoint->block_gen, block_gen, sizeof(block_gen));
+  checkpoint->num_snapshots = -1;
+  if (snapshots_changed) {
+    checkpoint->num_snapshots = num_snapshots;
+    checkpoint->snapshots = (struct _snapshot *) malloc(MAX_SNAPSHOTS * sizeof(struct _snapshot));
+    for (int i = 0; i < num_snapshots; i++) {
+      checkpoint->snapshots[i] = snapshots[i];
+      checkpoint->snapshots[i].metadata = (uint8_t *) malloc(METADATA_BLOCKS * BLOCK_SIZE);
+      memcpy(checkpoint->snapshots[i].metadata, snapshots[i].metadata, METADATA_BLOCKS * BLOCK_SIZE);
+    }
+    snapshots_changed = 0;
+  }
+  pinsRestore(live_free);
+  return checkpoint;
+}
+
+// Copy len bytes from the start of in to out, in the kernel when it can. A shorter
+// in is copied up to its end. Returns 0 or -1.
+int copyFile(int in, int out, off_t len){
+  off_t done = 0;
+  while (done < len) {
+    ssize_t bytes = copy_file_range(in, NULL, out, NULL, len - done, 0);
+    if (bytes <= 0) {
+      break;
+    }
+    done += bytes;
+  }
+  // across file systems, or with a kernel that cannot, copy through a buffer
+  uint8_t * buffer = (uint8_t *) malloc(TAR_BUFFER_SIZE);
+  int result = 0;
+  while (done < len) {
+    ssize_t bytes = pread(in, buffer, len - done < TAR_BUFFER_SIZE ? len - done : TAR_BUFFER_SIZE, done);
+    if (bytes == 0) {
+      break;
+    }
+    if (bytes < 0 || pwrite(out, buffer, bytes, done) != bytes) {
+      result = -1;
+      break;
+    }
+    done += bytes;
+  }
+  free(buffer);
+  return result;
+}
+
+// Write a checkpoint and rename it over its image. Needs no lock. Returns 0 or -1.
+int checkpointWrite(struct _checkpoint * checkpoint){
+  char temp_name[PATH_MAX];
+  snprintf(temp_name, PATH_MAX, "%s.ckpt", checkpoint->image);
+  int out = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out == -1) {
+    return -1;
+  }
+  off_t size = (off_t) NUM_BLOCKS * BLOCK_SIZE;
+  int ok = 1;
+  struct _ioEngine engine;
+  ioEngineOpen(&engine);
+  if (checkpoint->base) {
+    int in = open(checkpoint->image, O_RDONLY);
+    ok = in != -1 && copyFile(in, out, size) == 0;
+    if (in != -1) {
+      close(in);
+    }
+  }
+  // a short or missing image file reads back as zeros past its end
+  ok = ok && ftruncate(out, size) == 0;
+  for (int32_t i = 0; i < checkpoint->count && ok; i++) {
+    ioQueue(&engine, IO_WRITE, out, checkpoint->blocks + (size_t) i * BLOCK_SIZE, BLOCK_SIZE,
+            (off_t) checkpoint->indexes[i] * BLOCK_SIZE);
+  }
+  ok = ioDrain(&engine) != -1 && ok;
+  int32_t runs = 0;
+  ok = ok && punchRuns(out, checkpoint->free_map, &runs) != -1;
+  ioEngineDestroy(&engine);
+  // like savefs, the checkpoint replaces the image with the image's permissions
+  struct stat buf;
+  if (ok && stat(checkpoint->image, &buf) == 0) {
+    fchmod(out, buf.st_mode & 07777);
+  }
+  ok = ok && fsync(out) == 0;
+  close(out);
+  if (!ok || rename(temp_name, checkpoint->image) == -1) {
+    unlink(temp_name);
+    return -1;
+  }
+  writeGenerations(checkpoint->image, checkpoint->generation, checkpoint->block_gen);
+  if (checkpoint->num_snapshots != -1) {
+    writeSnapshots(checkpoint->image, checkpoint->snapshots, checkpoint->num_snapshots);
+  }
+  return 0;
+}
+
+// Write a checkpoint that was taken. Called with image_mutex held; in the background it
+// is released while the checkpoint is written.
+void checkpointRun(struct _checkpoint * checkpoint, int background){
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  checkpoint_running = 1;
+  if (background) {
+    pthread_mutex_unlock(&image_mutex);
+  }
+  int result = checkpointWrite(checkpoint);
+  int error = errno;
+  if (background) {
+    pthread_mutex_lock(&image_mutex);
+  }
+  checkpoint_running = 0;
+  autosaveRearm();
+  if (result == -1) {
+    printf("autosave: Checkpoint of %s failed: %s\n", checkpoint->image, strerror(error));
+    // what it held is still to be written, unless the image was let go meanwhile
+    if (image_open && strcmp(checkpoint->image, image_name) == 0) {
+      for (int32_t i = 0; i < checkpoint->count; i++) {
+        markDirty(checkpoint->indexes[i]);
+      }
+      if (checkpoint->num_snapshots != -1) {
+        snapshots_changed = 1;
+      }
+    }
+  }
+  else {
+    if (image_open && strcmp(checkpoint->image, image_name) == 0) {
+      memcpy(saved_free, checkpoint->free_map, NUM_DATA_BLOCKS);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    last_checkpoint_ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    num_checkpoints++;
+  }
+  pthread_cond_broadcast(&autosave_done);
+  checkpointFree(checkpoint);
+}
+
+// Whether the open image is due a checkpoint. Called with image_mutex held.
+int autosaveDue(){
+  // a compact image is written by savefs alone, see checkpointTake
+  if (!autosave_enabled || !image_open || image_read_only || image_compact || dirty_blocks == 0 ||
+      checkpoint_running || checkpoint_pending != NULL) {
+    return 0;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (int64_t) dirty_blocks * BLOCK_SIZE >= autosave_max_dirty ||
+         now.tv_sec > checkpoint_deadline.tv_sec ||
+         (now.tv_sec == checkpoint_deadline.tv_sec && now.tv_nsec >= checkpoint_deadline.tv_nsec);
+}
+
+// After a command: take a checkpoint that is due and hand it to the thread.
+void autosaveCheck(){
+  if (autosaveDue()) {
+    checkpoint_pending = checkpointTake();
+    if (checkpoint_pending != NULL) {
+      pthread_cond_signal(&autosave_wake);
+    }
+  }
+}
+
+void * autosaveWorker(void * arg){
+  (void) arg;
+  pthread_mutex_lock(&image_mutex);
+  while (autosave_enabled) {
+    int wait = 0;
+    while (autosave_enabled && checkpoint_pending == NULL && wait != ETIMEDOUT) {
+      wait = pthread_cond_timedwait(&autosave_wake, &image_mutex, &checkpoint_deadline);
+    }
+    // the interval passed while the prompt waited for input: take it here
+    if (checkpoint_pending == NULL && autosaveDue()) {
+      checkpoint_pending = checkpointTake();
+    }
+    if (checkpoint_pending != NULL) {
+      struct _checkpoint * checkpoint = checkpoint_pending;
+      checkpoint_pending = NULL;
+      checkpointRun(checkpoint, 1);
+    }
+    else if (wait == ETIMEDOUT) {
+      autosaveRearm();
+    }
+  }
+  pthread_mutex_unlock(&image_mutex);
+  return NULL;
+}
+
+// Wait for a checkpoint in flight. Called with image_mutex held.
+void autosaveWait(){
+  while (checkpoint_running || checkpoint_pending != NULL) {
+    pthread_cond_wait(&autosave_done, &image_mutex);
+  }
+}
+
+// Before the open image is let go: write what has changed since the last checkpoint.
+void autosaveFinish(){
+  if (!autosave_enabled) {
+    return;
+  }
+  autosaveWait();
+  struct _checkpoint * checkpoint = NULL;
+  if (image_open && !image_read_only && !image_compact && dirty_blocks > 0) {
+    checkpoint = checkpointTake();
+  }
+  if (checkpoint != NULL) {
+    checkpointRun(checkpoint, 0);
+  }
+}
+
+void autosaveStop(){
+  if (!autosave_enabled) {
+    return;
+  }
+  autosaveWait();
+  autosave_enabled = 0;
+  pthread_cond_broadcast(&autosave_wake);
+  // the thread needs the mutex to see that it has to stop
+  pthread_mutex_unlock(&image_mutex);
+  pthread_join(autosave_thread, NULL);
+  pthread_mutex_lock(&image_mutex);
+}
+
+void autosavefs(char * interval, char * max_dirty){
+  if (interval == NULL) {
+    if (!autosave_enabled) {
+      printf("Autosave is off\n");
+      return;
+    }
+    printf("Autosave every %d s or %lld KiB changed: %d checkpoints, last took %.1f ms, %lld KiB changed since\n",
+           autosave_interval, (long long) autosave_max_dirty / 1024, num_checkpoints, last_checkpoint_ms,
+           (long long) dirty_blocks * BLOCK_SIZE / 1024);
+    return;
+  }
+  if (strcmp(interval, "off") == 0) {
+    autosaveStop();
+    return;
+  }
+  if (image_open && image_compact) {
+    printf("autosave: %s is a compact image, which only savefs writes; savefs --flat converts it\n", image_name);
+    return;
+  }
+  int seconds = atoi(interval);
+  long long kib = max_dirty != NULL ? atoll(max_dirty) : AUTOSAVE_MAX_DIRTY;
+  if (seconds <= 0 || kib <= 0) {
+    printf("autosave: Expected a number of seconds and of KiB\n");
+    return;
+  }
+  autosave_interval = seconds;
+  autosave_max_dirty = kib * 1024;
+  autosaveRearm();
+  if (autosave_enabled) {
+    // the thread waits for the new deadline
+    pthread_cond_broadcast(&autosave_wake);
+    return;
+  }
+  autosave_enabled = 1;
+  num_checkpoints = 0;
+  if (pthread_create(&autosave_thread, NULL, autosaveWorker, NULL) != 0) {
+    perror("autosave");
+    autosave_enabled = 0;
+  }
+}
+
+// Pinned reads. A reader pins the file it reads under image_mutex: it takes a copy of
+// the inode, which keeps the file as it was when it was pinned, and counts itself in
+// block_refs of every block the file holds, the way a snapshot does. Only that file is
+// kept: the directory and other files go on changing, so a reader that pins several
+// files one after another sees each as it was at its own pin. Commands then leave those
+// blocks alone: write copies a pinned block before changing it (cowBlock) and delete
+// keeps it allocated (releaseBlock), so the reader carries on without the mutex and
+// neither waits for a writer nor makes one wait. Unpinning frees the blocks nothing
+// refers to any more; savefs and checkpoints already write them as free (pinsHide).
+//
+// Pins are per file on purpose. The only reader that runs beside commands is
+// retrieve <file> &, which reads one file. export, export-tar, read, list and fsck run
+// in the command thread and hold image_mutex from start to end, so no write comes
+// between their reads and they see one generation as it is. A pin of the whole
+// directory and inode table would cost a copy of METADATA_BLOCKS per reader (a
+// snapshot, in effect) for a reader that does not exist yet; one that walks several
+// files without the mutex should take a snapshot instead. open, close, createfs, use and
+// delta-apply wait for background reads of the image first. tests/mvcc_stress.c checks
+// readers under writes.
+struct _pin {
+  struct inode node;
+  int32_t inode_index;
+  struct _cipher cipher;
+  int encrypted;
+  uint8_t (*data)[BLOCK_SIZE];
+};
+
+pthread_cond_t readers_done = PTHREAD_COND_INITIALIZER;
+int background_readers = 0;
+
+// Whether the live file with inode inode_index holds block_index, most likely at
+// position b, where the pinned copy has it.
+int inodeHoldsBlock(int32_t inode_index, int b, int32_t block_index){
+  struct inode * node = &inodes[inode_index];
+  if (!node->in_use || (node->attribute & INLINE)) {
+    return 0;
+  }
+  if (node->blocks[b] == block_index) {
+    return 1;
+  }
+  for (int i = 0; i < BLOCKS_PER_FILE && node->blocks[i] != -1; i++) {
+    if (node->blocks[i] == block_index) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Count the blocks of a pinned file in block_refs (delta 1) or stop counting them (-1).
+// A block that no snapshot or pin refers to any more once the pin lets go is free
+// unless the file still holds it. No other file can: a block passes from one inode to
+// another only through the free map, which a pinned block never reaches.
+void pinBlocks(struct _pin * pin, int delta){
+  for (int b = 0; b < BLOCKS_PER_FILE && !(pin->node.attribute & INLINE) && pin->node.blocks[b] != -1; b++) {
+    int32_t block_index = pin->node.blocks[b];
+    if (block_index == HOLE_BLOCK) {
+      continue;
+    }
+    block_refs[block_index - FIRST_DATA_BLOCK] += delta;
+    if (delta < 0 && block_refs[block_index - FIRST_DATA_BLOCK] == 0 &&
+        !inodeHoldsBlock(pin->inode_index, b, block_index)) {
+      free_blocks[block_index - FIRST_DATA_BLOCK] = 1;
+    }
+  }
+}
+
+// Pin a file. Called with image_mutex held. Returns 0, or -1 when the file is
+// encrypted and no key is loaded.
+int pinFile(int32_t directory_entry, struct _pin * pin){
+  int missing;
+  pin->encrypted = fileCipher(directory_entry, &pin->cipher, &missing) != NULL;
+  if (missing) {
+    return -1;
+  }
+  pin->inode_index = directory[directory_entry].inode;
+  pin->node = inodes[pin->inode_index];
+  pin->data = data;
+  pinBlocks(pin, 1);
+  pinned_files++;
+  return 0;
+}
+
+// Called with image_mutex held, with the image of the pin in use.
+void unpinFile(struct _pin * pin){
+  pinned_files--;
+  // a block that the file let go of while it was pinned is free now
+  pinBlocks(pin, -1);
+}
+
+// readFileData for a pinned file. Needs no lock.
+void pinRead(struct _pin * pin, uint32_t offset, uint8_t * buf, uint32_t len){
+  while (len > 0) {
+    int32_t b = offset / BLOCK_SIZE;
+    uint32_t within = offset % BLOCK_SIZE;
+    uint32_t chunk = BLOCK_SIZE - within < len ? BLOCK_SIZE - within : len;
+    uint8_t * block = NULL;
+    if (pin->node.attribute & INLINE) {
+      block = (uint8_t *) pin->node.blocks + (size_t) b * BLOCK_SIZE;
+    }
+    else if (pin->node.blocks[b] != HOLE_BLOCK) {
+      block = pin->data[pin->node.blocks[b]];
+    }
+    if (block == NULL) {
+      memset(buf, 0, chunk);
+    }
+    else if (pin->encrypted) {
+      uint8_t plain[BLOCK_SIZE];
+      memcpy(plain, block, BLOCK_SIZE);
+      chachaBlock(&pin->cipher, b, plain);
+      memcpy(buf, plain + within, chunk);
+    }
+    else {
+      memcpy(buf, block + within, chunk);
+    }
+    buf += chunk;
+    offset += chunk;
+    len -= chunk;
+  }
+}
+
+// Wait for the background reads of the image in use. Called with image_mutex held.
+void pinDrain(){
+  while (background_readers > 0) {
+    pthread_cond_wait(&readers_done, &image_mutex);
+  }
+}
+
+struct _backgroundRead {
+  struct _pin pin;
+  int fd;
+  char target[PATH_MAX];
+};
+
+void * backgroundReadWorker(void * arg){
+  struct _backgroundRead * job = (struct _backgroundRead *) arg;
+  uint8_t * buffer = (uint8_t *) malloc(TAR_BUFFER_SIZE);
+  int failed = 0;
+  for (uint32_t offset = 0; offset < job->pin.node.file_size && !failed; offset += TAR_BUFFER_SIZE) {
+    uint32_t len = job->pin.node.file_size - offset < TAR_BUFFER_SIZE ? job->pin.node.file_size - offset : TAR_BUFFER_SIZE;
+    pinRead(&job->pin, offset, buffer, len);
+    failed = writeFull(job->fd, buffer, len) == -1;
+  }
+  failed = close(job->fd) == -1 || failed;
+  free(buffer);
+  pthread_mutex_lock(&image_mutex);
+  unpinFile(&job->pin);
+  if (failed) {
+    printf("retrieve: Writing %s failed\n", job->target);
+  }
+  background_readers--;
+  pthread_cond_broadcast(&readers_done);
+  pthread_mutex_unlock(&image_mutex);
+  free(job);
+  return NULL;
+}
+
+// retrieve <file> [<newfile>] &
+void retrievebgfs(char * filename, char * newfilename){
+  int32_t directory_entry = findDirectoryEntry(filename);
+  if (directory_entry == -1) {
+    printf("Error: File not found.\n");
+    return;
+  }
+  struct _backgroundRead * job = (struct _backgroundRead *) malloc(sizeof(struct _backgroundRead));
+  snprintf(job->target, PATH_MAX, "%s", newfilename != NULL ? newfilename : filename);
+  if (pinFile(directory_entry, &job->pin) == -1) {
+    printf("retrieve: %s is encrypted and no key is loaded\n", filename);
+    free(job);
+    return;
+  }
+  job->fd = open(job->target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  // counted before the worker exists, so pinDrain never misses it
+  background_readers++;
+  pthread_t thread;
+  if (job->fd == -1 || pthread_create(&thread, NULL, backgroundReadWorker, job) != 0) {
+    perror("retrieve");
+    background_readers--;
+    if (job->fd != -1) {
+      close(job->fd);
+    }
+    unpinFile(&job->pin);
+    free(job);
+    return;
+  }
+  pthread_detach(thread);
+  printf("Writing %u bytes to %s in the background\n", job->pin.node.file_size, job->target);
+}
+
+// Shared read-only images. open -ro maps the image file PROT_READ/MAP_SHARED instead
+// of reading it into image_memory, so any number of reader processes share the page
+// cache copy, and every command that could change the image is refused. A writer
+// holds an exclusive flock on <image>.lock for as long as the image is open, and
+// savefs replaces the image file by rename, so the file readers have mapped is
+// never changed under them.
+
+// Take the writer lock of an image into *lock, -1 when there is no lock file to take.
+// The image open now already holds its own lock, which is handed over. Returns 0, or
+// -1 if another process holds it.
+int lockImage(char * filename, int * lock){
+  *lock = -1;
+  if (image_lock != -1 && strcmp(filename, image_name) == 0) {
+    *lock = image_lock;
+    return 0;
+  }
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s.lock", filename);
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd == -1) {
+    // e.g. a read-only directory: nobody else can write the image there either
+    return 0;
+  }
+  if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+    printf("open: %s is open for writing in another process\n", filename);
+    close(fd);
+    return -1;
+  }
+  *lock = fd;
+  return 0;
+}
+
+// Give back a lock taken by lockImage that did not end up with an image.
+void unlockImage(int lock){
+  if (lock != -1 && lock != image_lock) {
+    close(lock);
+  }
+}
+
+// Drop the writer lock or the read-only mapping of the open image.
+void releaseImage(){
+  if (image_lock != -1) {
+    close(image_lock);
+    image_lock = -1;
+  }
+  if (image_read_only) {
+    // a compact image is read into image_buffer instead of being mapped
+    if (data != image_buffer) {
+      munmap(data, (size_t) NUM_BLOCKS * BLOCK_SIZE);
+    }
+    setImage(image_buffer);
+    image_read_only = 0;
+  }
+  image_compact = 0;
+}
+
+// The new image is opened, locked and checked before the open one is let go, so an
+// open that fails leaves the image that was open as it was.
+void openfs(char * filename, int read_only){
+  pinDrain();
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    printf("open: File not found\n");
+    return;
+  }
+  int compact = isCompact(fd);
+  void * image = NULL;
+  if (read_only && !compact) {
+    struct stat buf;
+    // mapping past the end of a short file would fault on access
+    if (fstat(fd, &buf) == -1 || buf.st_size < (off_t) NUM_BLOCKS * BLOCK_SIZE) {
+      printf("open: %s is not a complete image\n", filename);
+      close(fd);
+      return;
+    }
+    image = mmap(NULL, (size_t) NUM_BLOCKS * BLOCK_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED) {
+      perror("open");
+      close(fd);
+      return;
+    }
+  }
+  int lock = -1;
+  if (!read_only && lockImage(filename, &lock) == -1) {
+    close(fd);
+    return;
+  }
+  autosaveFinish();
+  // the lock is kept when the same image is opened again
+  if (lock == image_lock) {
+    image_lock = -1;
+  }
+  releaseImage();
+  image_lock = lock;
+  image_read_only = read_only;
+  image_compact = compact;
+  memset(image_name,0,64);
+  strncpy(image_name,filename, 63);
+  if (image != NULL) {
+    setImage((uint8_t (*)[BLOCK_SIZE]) image);
+  }
+  else if (compact) {
+    // read even when read-only: a compact image has nothing to map
+    if (compactRead(ioEngine(), fd) == -1) {
+      printf("open: %s is not a sound compact image\n", filename);
+      close(fd);
+      dropSnapshots();
+      releaseImage();
+      initialization();
+      return;
+    }
+  }
+  else {
+    // reads the contents of the file into system blocks
+    struct _ioEngine * engine = ioEngine();
+    for (int i = 0; i < NUM_BLOCKS; i += IO_CHUNK_BLOCKS) {
+      ioQueue(engine, IO_READ, fd, data[i], IO_CHUNK_BLOCKS * BLOCK_SIZE, (off_t) i * BLOCK_SIZE);
+    }
+    if (ioDrain(engine) == -1) {
+      perror("open");
+    }
+  }
+  close(fd);
+  // set to 1 to indicate that the filesystem image has been opened
+  image_open = 1;
+  if (read_only) {
+    dropSnapshots();
+  }
+  else {
+    loadSnapshots();
+  }
+  loadGenerations();
+  // the file holds everything now
+  if (!read_only) {
+    markClean();
+  }
+}
+
+void closefs() {
+  if (image_open == 0){
+    perror("Disk image is not open\n");
+    return; 
+  }
+  pinDrain();
+  autosaveFinish();
+  dropSnapshots();
+  releaseImage();
+  // set to 0 to indicate that the filesystem image has been opened
+  // 0 initialize image_name to 
+  image_open = 0;
+  memset(image_name,0,64);  
+}
+
+// create new file system on disk
+// initialize superblock then allocate inodes and data blocks
+// after that, create the root directory and set its metadata
+// finally, write the file system to disk
+void createfs (char * filename){
+  pinDrain();
+  // as in openfs, the image open now stays open until the new one is sure to work out
+  int lock = -1;
+  if (lockImage(filename, &lock) == -1) {
+    return;
+  }
+  // the file is only created here; savefs writes the image over it
+  file = fopen(filename, "a");
+  if (file == NULL) {
+    printf("createfs: %s: %s\n", filename, strerror(errno));
+    unlockImage(lock);
+    return;
+  }
+  autosaveFinish();
+  if (lock == image_lock) {
+    image_lock = -1;
+  }
+  releaseImage();
+  image_lock = lock;
+  memset(image_name,0,64);
+  strncpy(image_name,filename, 63);
+  memset(data,0,NUM_BLOCKS * BLOCK_SIZE);
+  image_open = 1;
+  for (int i = 0; i < NUM_FILES; i++){
+    directory[i].in_use = 0;
+    directory[i].inode = -1;
+    free_inodes[i] = 1;
+    memset(directory[i].filename, 0, sizeof(directory[0].filename));
+    for (int j = 0; j < BLOCKS_PER_FILE; j++){
+      inodes[i].blocks[j] = -1;
+    }
+    inodes[i].in_use = 0;
+    inodes[i].attribute = 0;
+    inodes[i].file_size = 0;
+  }  
+  for (int j = 0; j < NUM_DATA_BLOCKS; j++){
+    free_blocks[j] = 1;
+  } 
+  dropSnapshots();
+  // a new image starts out with every block in generation 1
+  generation = 1;
+  for (int j = 0; j < NUM_BLOCKS; j++){
+    block_gen[j] = 1;
+  }
+  resetGeneration();
+  // nothing of the new image is in its file yet
+  memset(block_dirty, 1, sizeof(block_dirty));
+  dirty_blocks = NUM_BLOCKS;
+  memset(saved_free, 0, sizeof(saved_free));
+  fclose(file);
+}
+
+int savefs (){
+  if (image_open == 0){
+    perror("Disk image is not open\n"); 
+    return -1;
+  }
+  commitGeneration();
+  autosaveWait();
+  // write a new file and rename it over the image: readers that mapped the old file
+  // keep a complete image, and a failed save leaves the old image in place
+  char temp_name[PATH_MAX];
+  snprintf(temp_name, PATH_MAX, "%s.tmp", image_name);
+  file = fopen(temp_name, "w");
+  if (file == NULL) {
+    perror("savefs");
+    return -1;
+  }
+  uint8_t * live_free = pinsHide();
+  struct _ioEngine * engine = ioEngine();
+  if (image_compact) {
+    int32_t count = 0;
+    int32_t * indexes = (int32_t *) malloc(NUM_BLOCKS * sizeof(int32_t));
+    uint8_t ** blocks = (uint8_t **) malloc(NUM_BLOCKS * sizeof(uint8_t *));
+    for (int32_t b = 0; b < NUM_BLOCKS; b++) {
+      if (blockInUse(b)) {
+        indexes[count] = b;
+        blocks[count++] = data[b];
+      }
+    }
+    int result = compactWrite(engine, fileno(file), count, indexes, blocks);
+    free(indexes);
+    free(blocks);
+    if (result == -1 || fsync(fileno(file)) == -1) {
+      perror("savefs");
+      fclose(file);
+      unlink(temp_name);
+      pinsRestore(live_free);
+      return -1;
+    }
+  }
+  //Save the current state of the filesystem by writing its data to a file,
+  //keeping up to the engine's queue depth of chunk writes in flight. Runs of free
+  //data blocks are left as holes.
+  for (int i = 0; i < NUM_BLOCKS && !image_compact; ) {
+    if (!blockInUse(i)) {
+      i++;
+      continue;
+    }
+    int run = 1;
+    while (run < IO_CHUNK_BLOCKS && i + run < NUM_BLOCKS && blockInUse(i + run)) {
+      run++;
+    }
+    ioQueue(engine, IO_WRITE, fileno(file), data[i], run * BLOCK_SIZE, (off_t) i * BLOCK_SIZE);
+    i += run;
+  }
+  if (!image_compact && (ioDrain(engine) == -1 || ftruncate(fileno(file), (off_t) NUM_BLOCKS * BLOCK_SIZE) == -1 ||
+      fflush(file) != 0 || fsync(fileno(file)) == -1)) {
+    perror("savefs");
+    fclose(file);
+    unlink(temp_name);
+    pinsRestore(live_free);
+    return -1;
+  }
+  // the new file takes the place of the image with the image's permissions
+  struct stat buf;
+  if (stat(image_name, &buf) == 0) {
+    fchmod(fileno(file), buf.st_mode & 07777);
+  }
+  fclose(file);
+  if (rename(temp_name, image_name) == -1) {
+    perror("savefs");
+    unlink(temp_name);
+    pinsRestore(live_free);
+    return -1;
+  }
+  saveSnapshots();
+  saveGenerations();
+  markClean();
+  pinsRestore(live_free);
+  snapshots_changed = 0;
+  return 0;
+}
+
+// Mounted images. open <image> as <alias> keeps the images open so far and opens one
+// more next to them; use <alias> makes it the image commands work on, and cp copies
+// files between them memory to memory. The image in use lives in the globals as ever:
+// while another one is in use, a mount holds them in its struct _mount (the image
+// itself by pointer, the per-image block state by copy) until use brings them back.
+// Each mount has a private copy of its own to open an image for writing into. Autosave
+// checkpoints the image in use; the others get their last checkpoint at quit.
+#define MAX_MOUNTS 8
+#define MAX_ALIAS 16
+
+struct _mount {
+  char alias[MAX_ALIAS];          // empty for the image opened without one
+  uint8_t (*buffer)[BLOCK_SIZE];  // image_buffer of the mount
+  // the globals of the image while another is in use
+  uint8_t (*data)[BLOCK_SIZE];
+  char image_name[64];
+  uint8_t image_open;
+  int image_read_only;
+  int image_lock;
+  int image_compact;
+  uint32_t generation;
+  int generation_dirty;
+  uint32_t * block_gen;
+  uint8_t * metadata_shadow;
+  uint8_t * block_dirty;
+  int32_t dirty_blocks;
+  uint8_t * saved_free;
+  uint16_t * block_refs;
+  struct _snapshot snapshots[MAX_SNAPSHOTS];
+  int num_snapshots;
+  int snapshots_changed;
+};
+
+struct _mount mounts[MAX_MOUNTS] = { { .buffer = image_memory } };
+int num_mounts = 1;
+int active_mount = 0;
+
+// Move the globals of the image in use into mount.
+void mountPark(struct _mount * mount){
+  if (mount->block_gen == NULL) {
+    mount->block_gen = (uint32_t *) malloc(sizeof(block_gen));
+    mount->metadata_shadow = (uint8_t *) malloc(sizeof(metadata_shadow));
+    mount->block_dirty = (uint8_t *) malloc(sizeof(block_dirty));
+    mount->saved_free = (uint8_t *) malloc(sizeof(saved_free));
+    mount->block_refs = (uint16_t *) malloc(sizeof(block_refs));
+  }
+  mount->data = data;
+  memcpy(mount->image_name, image_name, 64);
+  mount->image_open = image_open;
+  mount->image_read_only = image_read_only;
+  mount->image_lock = image_lock;
+  mount->image_compact = image_compact;
+  mount->generation = generation;
+  mount->generation_dirty = generation_dirty;
+  memcpy(mount->block_gen, block_gen, sizeof(block_gen));
+  memcpy(mount->metadata_shadow, metadata_shadow, sizeof(metadata_shadow));
+  memcpy(mount->block_dirty, block_dirty, sizeof(block_dirty));
+  mount->dirty_blocks = dirty_blocks;
+  memcpy(mount->saved_free, saved_free, sizeof(saved_free));
+  memcpy(mount->block_refs, block_refs, sizeof(block_refs));
+  // the snapshots' metadata copies change hands
+  memcpy(mount->snapshots, snapshots, sizeof(snapshots));
+  mount->num_snapshots = num_snapshots;
+  mount->snapshots_changed = snapshots_changed;
+}
+
+// Put the globals of a parked image back.
+void mountRestore(struct _mount * mount){
+  image_buffer = mount->buffer;
+  setImage(mount->data);
+  memcpy(image_name, mount->image_name, 64);
+  image_open = mount->image_open;
+  image_read_only = mount->image_read_only;
+  image_lock = mount->image_lock;
+  image_compact = mount->image_compact;
+  generation = mount->generation;
+  generation_dirty = mount->generation_dirty;
+  memcpy(block_gen, mount->block_gen, sizeof(block_gen));
+  memcpy(metadata_shadow, mount->metadata_shadow, sizeof(metadata_shadow));
+  memcpy(block_dirty, mount->block_dirty, sizeof(block_dirty));
+  dirty_blocks = mount->dirty_blocks;
+  memcpy(saved_free, mount->saved_free, sizeof(saved_free));
+  memcpy(block_refs, mount->block_refs, sizeof(block_refs));
+  memcpy(snapshots, mount->snapshots, sizeof(snapshots));
+  num_snapshots = mount->num_snapshots;
+  snapshots_changed = mount->snapshots_changed;
+}
+
+int findMount(char * alias){
+  for (int i = 0; i < num_mounts; i++) {
+    if (strcmp(mounts[i].alias, alias) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Make mount index the image in use.
+void mountUse(int index){
+  if (index == active_mount) {
+    return;
+  }
+  // background reads and a checkpoint in flight finish against the image they started on
+  pinDrain();
+  autosaveWait();
+  mountPark(&mounts[active_mount]);
+  mountRestore(&mounts[index]);
+  active_mount = index;
+}
+
+void mountOpen(char * filename, int read_only, char * alias){
+  int valid = strlen(alias) > 0 && strlen(alias) < MAX_ALIAS;
+  for (int i = 0; alias[i] != '\0'; i++) {
+    valid = valid && isalnum((unsigned char) alias[i]);
+  }
+  if (!valid) {
+    printf("open: Aliases are up to %d letters and digits\n", MAX_ALIAS - 1);
+    return;
+  }
+  if (findMount(alias) != -1) {
+    printf("open: %s is already open\n", alias);
+    return;
+  }
+  if (num_mounts == MAX_MOUNTS) {
+    printf("open: No more than %d images can be open\n", MAX_MOUNTS);
+    return;
+  }
+  void * buffer = mmap(NULL, (size_t) NUM_BLOCKS * BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffer == MAP_FAILED) {
+    perror("open");
+    return;
+  }
+  int home = active_mount;
+  pinDrain();
+  autosaveWait();
+  mountPark(&mounts[home]);
+  // a fresh image state to open into
+  struct _mount * mount = &mounts[num_mounts];
+  memset(mount, 0, sizeof(struct _mount));
+  strcpy(mount->alias, alias);
+  mount->buffer = (uint8_t (*)[BLOCK_SIZE]) buffer;
+  image_buffer = mount->buffer;
+  initialization();
+  image_read_only = 0;
+  image_lock = -1;
+  image_compact = 0;
+  generation = 1;
+  generation_dirty = 0;
+  memset(block_gen, 0, sizeof(block_gen));
+  memset(block_dirty, 0, sizeof(block_dirty));
+  dirty_blocks = 0;
+  memset(saved_free, 0, sizeof(saved_free));
+  memset(block_refs, 0, sizeof(block_refs));
+  num_snapshots = 0;
+  snapshots_changed = 0;
+  openfs(filename, read_only);
+  if (!image_open) {
+    munmap(buffer, (size_t) NUM_BLOCKS * BLOCK_SIZE);
+    mountRestore(&mounts[home]);
+    return;
+  }
+  active_mount = num_mounts++;
+}
+
+// close: an image opened under an alias goes away with its mount.
+void mountClose(){
+  closefs();
+  if (active_mount == 0 || image_open) {
+    return;
+  }
+  struct _mount * mount = &mounts[active_mount];
+  munmap(mount->buffer, (size_t) NUM_BLOCKS * BLOCK_SIZE);
+  free(mount->block_gen);
+  free(mount->metadata_shadow);
+  free(mount->block_dirty);
+  free(mount->saved_free);
+  free(mount->block_refs);
+  memmove(mount, mount + 1, (num_mounts - active_mount - 1) * sizeof(struct _mount));
+  num_mounts--;
+  mountRestore(&mounts[0]);
+  active_mount = 0;
+}
+
+void usefs(char * alias){
+  if (alias != NULL) {
+    int index = strcmp(alias, "-") == 0 ? 0 : findMount(alias);
+    if (index == -1) {
+      printf("use: No image is open as %s\n", alias);
+      return;
+    }
+    mountUse(index);
+    return;
+  }
+  for (int i = 0; i < num_mounts; i++) {
+    int open = i == active_mount ? image_open : mounts[i].image_open;
+    int read_only = i == active_mount ? image_read_only : mounts[i].image_read_only;
+    printf("%c %-16s %s%s\n", i == active_mount ? '*' : ' ', i == 0 ? "-" : mounts[i].alias,
+           !open ? "(closed)" : i == active_mount ? image_name : mounts[i].image_name,
+           open && read_only ? " (read-only)" : "");
+  }
+}
+
+// Split [<alias>:]<file> into the mount and the file name. Returns the mount, or -1.
+int mountPath(char * path, char ** filename){
+  char * colon = strchr(path, ':');
+  if (colon == NULL) {
+    *filename = path;
+    return active_mount;
+  }
+  *colon = '\0';
+  *filename = colon + 1;
+  int index = strcmp(path, "-") == 0 ? 0 : findMount(path);
+  if (index == -1) {
+    printf("cp: No image is open as %s\n", path);
+  }
+  return index;
+}
+
+// Copy a file between open images, or within one. Its blocks are copied memory to memory
+// as they are stored. An encrypted copy is then encrypted again under a salt of its own,
+// since two files under one key would share keystream; that needs the key loaded.
+void cpfs(char * source, char * target){
+  char * source_name;
+  char * target_name;
+  int from = mountPath(source, &source_name);
+  int to = from == -1 ? -1 : mountPath(target, &target_name);
+  if (to == -1) {
+    return;
+  }
+  if (strlen(target_name) == 0 || strlen(target_name) > MAX_NAME_SIZE) {
+    printf("cp: Invalid file name %s\n", target_name);
+    return;
+  }
+  int home = active_mount;
+  mountUse(from);
+  int32_t entry = image_open ? findDirectoryEntry(source_name) : -1;
+  if (entry == -1) {
+    printf("cp: %s not found\n", source_name);
+    mountUse(home);
+    return;
+  }
+  struct inode node = inodes[directory[entry].inode];
+  uint8_t salt[sizeof(directory[0].salt)];
+  memcpy(salt, directory[entry].salt, sizeof(salt));
+  uint8_t (*source_data)[BLOCK_SIZE] = data;
+
+  mountUse(to);
+  int32_t needed = 0;
+  for (int b = 0; b < BLOCKS_PER_FILE && !(node.attribute & INLINE) && node.blocks[b] != -1; b++) {
+    needed += node.blocks[b] != HOLE_BLOCK;
+  }
+  int32_t free_entry = -1;
+  for (int i = 0; i < NUM_FILES && image_open; i++) {
+    if (!directory[i].in_use) {
+      free_entry = i;
+      break;
+    }
+  }
+  int32_t inode_index = image_open ? findFreeInode() : -1;
+  if (!image_open || image_read_only) {
+    printf("cp: The target image is not open for writing\n");
+  }
+  else if (findDirectoryEntry(target_name) != -1) {
+    printf("cp: %s already exists\n", target_name);
+  }
+  else if (free_entry == -1 || inode_index == -1) {
+    printf("cp: The target image has no free directory entry\n");
+  }
+  else if ((int64_t) needed * BLOCK_SIZE > dffs()) {
+    printf("cp: Not enough disk space\n");
+  }
+  else if ((node.attribute & ENCRYPTED) && !master_key_loaded) {
+    printf("cp: %s is encrypted and no key is loaded\n", source_name);
+  }
+  else {
+    int32_t cursor = 0;
+    for (int b = 0; b < BLOCKS_PER_FILE && !(node.attribute & INLINE) && node.blocks[b] != -1; b++) {
+      if (node.blocks[b] == HOLE_BLOCK) {
+        continue;
+      }
+      while (!free_blocks[cursor]) {
+        cursor++;
+      }
+      free_blocks[cursor] = 0;
+      memcpy(data[FIRST_DATA_BLOCK + cursor], source_data[node.blocks[b]], BLOCK_SIZE);
+      touchBlock(FIRST_DATA_BLOCK + cursor);
+      node.blocks[b] = FIRST_DATA_BLOCK + cursor;
+    }
+    inodes[inode_index] = node;
+    inodes[inode_index].in_use = 1;
+    free_inodes[inode_index] = 0;
+    memset(directory[free_entry].filename, 0, sizeof(directory[0].filename));
+    strcpy(directory[free_entry].filename, target_name);
+    memcpy(directory[free_entry].salt, salt, sizeof(salt));
+    directory[free_entry].inode = inode_index;
+    directory[free_entry].in_use = 1;
+    // the copy's blocks are its own, so this cannot run out of space, but it can run
+    // out of randomness for the salt: then the copy is dropped, not kept in plaintext
+    int dropped = 0;
+    if (node.attribute & ENCRYPTED) {
+      struct _cipher cipher;
+      fileKey(free_entry, &cipher);
+      chachaFile(free_entry, &cipher);
+      inodes[inode_index].attribute &= ~ENCRYPTED;
+      dropped = encryptNewFile(free_entry) == -1;
+    }
+    // the main loop only closes the generation of the image in use
+    commitGeneration();
+    if (dropped) {
+      printf("cp: %s could not be encrypted and was not copied\n", target_name);
+    }
+    else {
+      printf("Copied %u bytes to %s\n", node.file_size, target_name);
+    }
+  }
+  mountUse(home);
+}
+
+// Before quitting: the last checkpoint of every open image.
+void mountFinish(){
+  for (int i = 0; i < num_mounts && autosave_enabled; i++) {
+    mountUse(i);
+    autosaveFinish();
+  }
+}
+
+void attribfs (char * filename, int attri, int set) {
+  int file_found = 0;
+  //Searches for the file in the directory and updates the corresponding inode's attribute.
+  for (int i = 0; i < NUM_FILES; i++){
+    int32_t inode_index = directory[i].inode;
+    if (directory[i].in_use && strcmp(directory[i].filename, filename) == 0) {
+      file_found = 1;
+      // if attri  = 1 (hidden) and set = 1 (set) -> set hidden 
+      if (set == 1){
+        if (attri == 1){
+          inodes[inode_index].attribute |= HIDDEN;
+        } 
+        // if attri  = 2 (readonly) and set = 1 (set) -> set readonly
+        if (attri == 2){
+          inodes[inode_index].attribute |= READONLY;
+        }
+        // if attri  = 3 (encrypted) and set = 1 (set) -> encrypt with the loaded key
+        if ((attri == 3) && !(inodes[inode_index].attribute & ENCRYPTED)){
+          encryptFile(i);
+        }
+      }
+      else{ //otherwise set = 0 (remove)
+        // if in hidden category and it is not hidden  -> remove    
+        if ((attri == 1) &&  ( inodes[inode_index].attribute & HIDDEN ) ){
+          inodes[inode_index].attribute &= ~(HIDDEN);
+        }
+        // if in readonly category and it is not readonly  -> remove  
+        if ((attri == 2) && ( inodes[inode_index].attribute & READONLY )){
+          inodes[inode_index].attribute &= ~(READONLY);
+        }
+        // if in encrypted category and it is encrypted -> store it in plaintext again
+        if ((attri == 3) && ( inodes[inode_index].attribute & ENCRYPTED )){
+          struct _cipher cipher;
+          fileKey(i, &cipher);
+          if (chachaFile(i, &cipher) == -1) {
+            printf("Not enough disk space to copy %s away from its snapshots.\n", filename);
+          }
+          else {
+            inodes[inode_index].attribute &= ~(ENCRYPTED);
+            punchZeroBlocks(inode_index);
+          }
+        }
+      }
+      break;
+    }
+  }
+  if (!file_found) {
+    printf("File not found\n");
+  }  
+}
+
+void encryptfs(char *filename, uint8_t cipher) {
+  // Open the file in read-write binary mode
+  FILE *fp = fopen(filename, "r+b");
+  if (fp == NULL) {
+    printf("Error: File '%s' not found!\n", filename);
+    return;
+  }
+  // Get the file size and check if it exceeds the maximum file size
+  fseek(fp, 0L, SEEK_END);
+  int32_t file_size = ftell(fp);
+  fseek(fp, 0L, SEEK_SET);
+
+  if (file_size > MAX_FILE_SIZE) {
+    printf("Error: File '%s' exceeds maximum size of %d bytes!\n", filename, MAX_FILE_SIZE);
+    return;
+  }
+  // Calculate the number of blocks needed to store the file
+  int32_t blocks_needed = file_size / BLOCK_SIZE + 1;
+
+  int32_t inode_index = -1;
+  int32_t block_index = -1;
+  // Find or allocate an inode for the file
+  for (int i = 0; i < NUM_FILES; i++) {
+    if (directory[i].in_use && strcmp(directory[i].filename, filename) == 0) {
+      inode_index = directory[i].inode;
+      break;
+    }
+  }
+  // the blocks below replace the bytes of an inline file
+  if (inode_index != -1 && (inodes[inode_index].attribute & INLINE)) {
+    memset(inodes[inode_index].blocks, 0xff, sizeof(inodes[inode_index].blocks));
+  }
+
+  if (inode_index == -1) {
+    inode_index = findFreeInode();
+    if (inode_index == -1) {
+      printf("Error: Could not find free inode to store file '%s'!\n", filename);
+      return;
+    }
+    // then update the directory entry to active
+    directory[inode_index].in_use = 1;
+    directory[inode_index].inode = inode_index;
+    strcpy(directory[inode_index].filename, filename);
+    free_inodes[inode_index] = 0;
+  }
+  // Store the file in its blocks, allocating those it does not have yet
+  for (int i = 0; i < blocks_needed; i++) {
+    // the file keeps its own blocks; one a snapshot shares is copied first (cowBlock)
+    if (inodes[inode_index].blocks[i] == -1) {
+      inodes[inode_index].blocks[i] = HOLE_BLOCK;
+    }
+    block_index = cowBlock(inode_index, i);
+    if (block_index == -1) {
+      printf("Error: Could not find free block to store file '%s'!\n", filename);
+      return;
+    }
+    if (i == 0) {
+      inodes[inode_index].in_use = 1;
+      inodes[inode_index].attribute = 0;
+      inodes[inode_index].file_size = file_size;
+    }
+    // Read a block of data from the file and encrypt it
+    uint8_t buf[BLOCK_SIZE];
+    memset(buf, 0, BLOCK_SIZE);
+    fread(buf, 1, BLOCK_SIZE, fp);
+    for (int j = 0; j < BLOCK_SIZE; j++) {
+      buf[j] ^= cipher;
+    }
+    // Store the encrypted data in the image and write it back to the file
+    memcpy(data[block_index], buf, BLOCK_SIZE);
+    touchBlock(block_index);
+    fseek(fp, i * BLOCK_SIZE, SEEK_SET);
+    fwrite(buf, 1, BLOCK_SIZE, fp);
+  }
+  // blocks past the new end of the file are given back
+  for (int i = blocks_needed; i < BLOCKS_PER_FILE && inodes[inode_index].blocks[i] != -1; i++) {
+    if (inodes[inode_index].blocks[i] != HOLE_BLOCK) {
+      releaseBlock(inodes[inode_index].blocks[i]);
+    }
+    inodes[inode_index].blocks[i] = -1;
+  }
+
+  fclose(fp);
+  printf("File '%s' encrypted successfully!\n", filename);
+}
+// same as encrypts
+// In XOR cipher, a bitwise XOR operation is performed on the
+// plaintext with a key to generate the ciphertext.
+//To decrypt the ciphertext, the same key is used to perform the XOR operation again
+void decryptfs(char *filename, uint8_t cipher) {
+  FILE *fp = fopen(filename, "r+b");
+  if (fp == NULL) {
+    printf("Error: File '%s' not found!\n", filename);
+    return;
+  }
+  
+  fseek(fp, 0L, SEEK_END);
+  int32_t file_size = ftell(fp);
+  fseek(fp, 0L, SEEK_SET);
+
+  if (file_size > MAX_FILE_SIZE) {
+    printf("Error: File '%s' exceeds maximum size of %d bytes!\n", filename, MAX_FILE_SIZE);
+    return;
+  }
+
+  int32_t blocks_needed = file_size / BLOCK_SIZE + 1;
+
+  int32_t inode_index = -1;
+  int32_t block_index = -1;
+
+  for (int i = 0; i < NUM_FILES; i++) {
+    if (directory[i].in_use && strcmp(directory[i].filename, filename) == 0) {
+      inode_index = directory[i].inode;
+      break;
+    }
+  }
+  // the blocks below replace the bytes of an inline file
+  if (inode_index != -1 && (inodes[inode_index].attribute & INLINE)) {
+    memset(inodes[inode_index].blocks, 0xff, sizeof(inodes[inode_index].blocks));
+  }
+
+  if (inode_index == -1) {
+    inode_index = findFreeInode();
+    if (inode_index == -1) {
+      printf("Error: Could not find free inode to store file '%s'!\n", filename);
+      return;
+    }
+    directory[inode_index].in_use = 1;
+    directory[inode_index].inode = inode_index;
+    strcpy(directory[inode_index].filename, filename);
+    free_inodes[inode_index] = 0;
+  }
+
+  for (int i = 0; i < blocks_needed; i++) {
+    // the file keeps its own blocks; one a snapshot shares is copied first (cowBlock)
+    if (inodes[inode_index].blocks[i] == -1) {
+      inodes[inode_index].blocks[i] = HOLE_BLOCK;
+    }
+    block_index = cowBlock(inode_index, i);
+    if (block_index == -1) {
+      printf("Error: Could not find free block to store file '%s'!\n", filename);
+      return;
+    }
+    if (i == 0) {
+      inodes[inode_index].in_use = 1;
+      inodes[inode_index].attribute = 0;
+      inodes[inode_index].file_size = file_size;
+    }
+
+    uint8_t buf[BLOCK_SIZE];
+    memset(buf, 0, BLOCK_SIZE);
+    fread(buf, 1, BLOCK_SIZE, fp);
+    for (int j = 0; j < BLOCK_SIZE; j++) {
+      buf[j] ^= cipher;
+    }
+    memcpy(data[block_index], buf, BLOCK_SIZE);
+    touchBlock(block_index);
+    fseek(fp, i * BLOCK_SIZE, SEEK_SET);
+    fwrite(buf, 1, BLOCK_SIZE, fp);
+  }
+  for (int i = blocks_needed; i < BLOCKS_PER_FILE && inodes[inode_index].blocks[i] != -1; i++) {
+    if (inodes[inode_index].blocks[i] != HOLE_BLOCK) {
+      releaseBlock(inodes[inode_index].blocks[i]);
+    }
+    inodes[inode_index].blocks[i] = -1;
+  }
+
+  fclose(fp);
+  printf("File '%s' decrypted successfully!\n", filename);
+}
+
+
+
+void dispatch(char * token[], int token_count);
+
+// Workload traces. trace <file> appends every command dispatched from the prompt (or
+// from one-shot mode when MFS_TRACE names a trace file) to a binary trace: when it
+// started, how long it took, the total size of the host files it reads, and the
+// arguments themselves. trace -c <file> also captures the contents of the
+// files read by insert, write, append, import-tar and delta-apply, so the trace can
+// be replayed on another host. replay <file> reruns a trace against the open image,
+// as fast as possible or with -p at the original pacing, and reports throughput and
+// the slowest operations.
+
+#define TRACE_MAGIC "MFSTRC01"
+#define TRACE_SLOWEST 10
+
+struct _traceRecord {
+  uint64_t start;       // CLOCK_REALTIME in ns when the command started
+  uint64_t duration;    // ns the command took
+  uint64_t input_bytes; // size of the host files the command reads
+  uint32_t token_count; // arguments, each NUL terminated, empty for a missing one
+  uint32_t token_bytes;
+  uint32_t num_files;   // captured files that follow the arguments
+  uint32_t pad;
+};
+
+struct _traceFile {
+  uint64_t size;
+  uint32_t name_bytes;  // NUL terminated path, then size bytes of contents
+  uint32_t pad;
+};
+
+int trace_fd = -1;
+int trace_capture = 0;
+
+uint64_t traceClock(clockid_t clock){
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Stop recording.
+void traceStop(){
+  if (trace_fd != -1) {
+    close(trace_fd);
+    trace_fd = -1;
+  }
+}
+
+// Start appending to the trace file, writing its header if it is new.
+int traceStart(char * filename, int capture){
+  traceStop();
+  int fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd == -1) {
+    printf("trace: %s: %s\n", filename, strerror(errno));
+    return -1;
+  }
+  struct stat buf;
+  if (fstat(fd, &buf) == 0 && buf.st_size == 0 && writeFull(fd, TRACE_MAGIC, 8) == -1) {
+    printf("trace: %s: %s\n", filename, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  trace_fd = fd;
+  trace_capture = capture;
+  return 0;
+}
+
+// Commands whose file arguments are read from the host.
+int traceReadsFiles(char * command){
+  return strcmp(command, "insert") == 0 || strcmp(command, "write") == 0 || strcmp(command, "append") == 0 ||
+         strcmp(command, "import-tar") == 0 || strcmp(command, "delta-apply") == 0;
+}
+
+// The host file a command argument names, or NULL. write and append only read the
+// host file of an @hostfile argument.
+char * traceInputPath(char * command, char * argument){
+  if (argument == NULL) {
+    return NULL;
+  }
+  if (strcmp(command, "write") == 0 || strcmp(command, "append") == 0) {
+    return argument[0] == '@' ? argument + 1 : NULL;
+  }
+  return argument;
+}
+
+// Capturing is limited to relative paths, which replay recreates under a scratch directory.
+int traceCapturable(char * path){
+  return path[0] != '/' && strstr(path, "..") == NULL;
+}
+
+// Run one command, appending it to the trace when recording.
+void traceDispatch(char * token[], int token_count){
+  // key is left out so that traces never hold keys
+  if (trace_fd == -1 || token[0] == NULL || strcmp(token[0], "key") == 0) {
+    dispatch(token, token_count);
+    return;
+  }
+  // the record is assembled before the command runs, while its input files are as it saw them
+  struct _traceRecord record;
+  memset(&record, 0, sizeof(record));
+  record.token_count = token_count;
+  size_t size = sizeof(record);
+  for (int i = 0; i < token_count; i++) {
+    size += (token[i] != NULL ? strlen(token[i]) : 0) + 1;
+  }
+  int reads_files = traceReadsFiles(token[0]);
+  for (int i = 1; i < token_count && reads_files; i++) {
+    struct stat buf;
+    char * path = traceInputPath(token[0], token[i]);
+    if (path == NULL || stat(path, &buf) == -1 || !S_ISREG(buf.st_mode)) {
+      continue;
+    }
+    record.input_bytes += buf.st_size;
+    if (trace_capture && reads_files && traceCapturable(path)) {
+      size += sizeof(struct _traceFile) + strlen(path) + 1 + buf.st_size;
+    }
+  }
+  uint8_t * buffer = (uint8_t *) malloc(size);
+  size_t used = sizeof(record);
+  for (int i = 0; i < token_count; i++) {
+    size_t length = token[i] != NULL ? strlen(token[i]) : 0;
+    memcpy(buffer + used, token[i] != NULL ? token[i] : "", length + 1);
+    used += length + 1;
+  }
+  record.token_bytes = used - sizeof(record);
+  for (int i = 1; i < token_count && trace_capture && reads_files; i++) {
+    struct stat buf;
+    char * path = traceInputPath(token[0], token[i]);
+    if (path == NULL || !traceCapturable(path) || stat(path, &buf) == -1 || !S_ISREG(buf.st_mode) ||
+        used + sizeof(struct _traceFile) + strlen(path) + 1 + buf.st_size > size) {
+      continue;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+      continue;
+    }
+    struct _traceFile traced;
+    memset(&traced, 0, sizeof(traced));
+    traced.name_bytes = strlen(path) + 1;
+    uint8_t * contents = buffer + used + sizeof(traced) + traced.name_bytes;
+    ssize_t bytes = readFull(fd, contents, buf.st_size);
+    close(fd);
+    if (bytes < 0) {
+      continue;
+    }
+    traced.size = bytes;
+    memcpy(buffer + used, &traced, sizeof(traced));
+    memcpy(buffer + used + sizeof(traced), path, traced.name_bytes);
+    used += sizeof(traced) + traced.name_bytes + bytes;
+    record.num_files++;
+  }
+
+  record.start = traceClock(CLOCK_REALTIME);
+  uint64_t start = traceClock(CLOCK_MONOTONIC);
+  dispatch(token, token_count);
+  record.duration = traceClock(CLOCK_MONOTONIC) - start;
+  memcpy(buffer, &record, sizeof(record));
+  // the command may have been trace off
+  if (trace_fd != -1 && writeFull(trace_fd, buffer, used) == -1) {
+    printf("trace: %s\n", strerror(errno));
+    traceStop();
+  }
+  free(buffer);
+}
+
+struct _traceOp {
+  uint64_t duration;
+  uint64_t original;
+  char command[64];
+};
+
+// Commands left out of a replay: they would switch away from the image being replayed onto.
+int traceSkipped(char * command){
+  return strcmp(command, "open") == 0 || strcmp(command, "close") == 0 || strcmp(command, "createfs") == 0 ||
+         strcmp(command, "quit") == 0 || strcmp(command, "trace") == 0 || strcmp(command, "replay") == 0;
+}
+
+void replayfs(char * filename, int paced){
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    printf("replay: %s: %s\n", filename, strerror(errno));
+    return;
+  }
+  char magic[8];
+  if (readFull(fd, magic, 8) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0) {
+    printf("replay: %s is not a trace\n", filename);
+    close(fd);
+    return;
+  }
+  // captured files are recreated under a scratch directory that replayed commands run in
+  char scratch[PATH_MAX] = "";
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, PATH_MAX) == NULL) {
+    perror("replay");
+    close(fd);
+    return;
+  }
+  // commands print as they normally would; the replay report is what matters here
+  fflush(stdout);
+  int saved_stdout = dup(STDOUT_FILENO);
+  int null_fd = open("/dev/null", O_WRONLY);
+
+  struct _traceOp slowest[TRACE_SLOWEST];
+  int num_slowest = 0;
+  long ops = 0;
+  uint64_t bytes = 0;
+  uint64_t first_start = 0;
+  uint64_t replay_start = traceClock(CLOCK_MONOTONIC);
+  struct _traceRecord record;
+  while (readFull(fd, &record, sizeof(record)) == sizeof(record)) {
+    char * arguments = (char *) malloc(record.token_bytes + 1);
+    if (readFull(fd, arguments, record.token_bytes) != record.token_bytes || record.token_count > MAX_NUM_ARGUMENTS) {
+      printf("replay: %s is truncated\n", filename);
+      free(arguments);
+      break;
+    }
+    arguments[record.token_bytes] = '\0';
+    char * token[MAX_NUM_ARGUMENTS];
+    char * argument = arguments;
+    for (int i = 0; i < MAX_NUM_ARGUMENTS; i++) {
+      token[i] = NULL;
+      if (i < (int) record.token_count && argument < arguments + record.token_bytes) {
+        token[i] = *argument != '\0' ? argument : NULL;
+        argument += strlen(argument) + 1;
+      }
+    }
+    int failed = 0;
+    for (uint32_t f = 0; f < record.num_files && !failed; f++) {
+      struct _traceFile traced;
+      if (readFull(fd, &traced, sizeof(traced)) != sizeof(traced) || traced.name_bytes == 0 ||
+          traced.name_bytes > PATH_MAX) {
+        failed = 1;
+        break;
+      }
+      char name[PATH_MAX];
+      uint8_t * contents = (uint8_t *) malloc(traced.size > 0 ? traced.size : 1);
+      if (readFull(fd, name, traced.name_bytes) != traced.name_bytes ||
+          readFull(fd, contents, traced.size) != (ssize_t) traced.size) {
+        free(contents);
+        failed = 1;
+        break;
+      }
+      name[traced.name_bytes - 1] = '\0';
+      if (scratch[0] == '\0') {
+        snprintf(scratch, PATH_MAX, "%s/mfs-replay-XXXXXX", getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp");
+        if (mkdtemp(scratch) == NULL) {
+          perror("replay");
+          scratch[0] = '\0';
+          free(contents);
+          failed = 1;
+          break;
+        }
+      }
+      char path[2 * PATH_MAX];
+      snprintf(path, sizeof(path), "%s/%s", scratch, name);
+      // create the directories leading up to the file
+      for (char * slash = strchr(path + strlen(scratch) + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(path, 0755);
+        *slash = '/';
+      }
+      int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (out == -1 || writeFull(out, contents, traced.size) == -1) {
+        printf("replay: %s: %s\n", path, strerror(errno));
+      }
+      if (out != -1) {
+        close(out);
+      }
+      free(contents);
+    }
+    if (failed) {
+      printf("replay: %s is truncated\n", filename);
+      free(arguments);
+      break;
+    }
+    if (token[0] == NULL || traceSkipped(token[0])) {
+      free(arguments);
+      continue;
+    }
+
+    if (first_start == 0) {
+      first_start = record.start;
+    }
+    if (paced) {
+      uint64_t due = replay_start + (record.start - first_start);
+      uint64_t now = traceClock(CLOCK_MONOTONIC);
+      if (due > now) {
+        struct timespec wait = { (time_t) ((due - now) / 1000000000ull), (long) ((due - now) % 1000000000ull) };
+        nanosleep(&wait, NULL);
+      }
+    }
+    if (record.num_files > 0 && chdir(scratch) == -1) {
+      perror("replay");
+    }
+    fflush(stdout);
+    if (null_fd != -1) {
+      dup2(null_fd, STDOUT_FILENO);
+    }
+    uint64_t start = traceClock(CLOCK_MONOTONIC);
+    dispatch(token, record.token_count);
+    if (image_open && !image_read_only) {
+      commitGeneration();
+    }
+    uint64_t duration = traceClock(CLOCK_MONOTONIC) - start;
+    fflush(stdout);
+    if (saved_stdout != -1) {
+      dup2(saved_stdout, STDOUT_FILENO);
+    }
+    if (record.num_files > 0 && chdir(cwd) == -1) {
+      perror("replay");
+    }
+    ops++;
+    bytes += record.input_bytes;
+
+    // keep the slowest operations sorted, slowest first
+    int position = num_slowest;
+    while (position > 0 && slowest[position - 1].duration < duration) {
+      position--;
+    }
+    if (position < TRACE_SLOWEST) {
+      int last = num_slowest < TRACE_SLOWEST ? num_slowest : TRACE_SLOWEST - 1;
+      memmove(&slowest[position + 1], &slowest[position], (last - position) * sizeof(struct _traceOp));
+      slowest[position].duration = duration;
+      slowest[position].original = record.duration;
+      snprintf(slowest[position].command, sizeof(slowest[position].command), "%s", token[0]);
+      for (int i = 1; i < (int) record.token_count; i++) {
+        size_t length = strlen(slowest[position].command);
+        if (token[i] != NULL && length + 1 < sizeof(slowest[position].command)) {
+          snprintf(slowest[position].command + length, sizeof(slowest[position].command) - length, " %s", token[i]);
+        }
+      }
+      if (num_slowest < TRACE_SLOWEST) {
+        num_slowest++;
+      }
+    }
+    free(arguments);
+  }
+  close(fd);
+  if (null_fd != -1) {
+    close(null_fd);
+  }
+  if (saved_stdout != -1) {
+    close(saved_stdout);
+  }
+
+  double seconds = (traceClock(CLOCK_MONOTONIC) - replay_start) / 1e9;
+  printf("Replayed %ld operations, %llu input bytes in %.3f s (%.1f ops/s, %.1f MB/s)\n", ops,
+         (unsigned long long) bytes, seconds, seconds > 0 ? ops / seconds : 0.0,
+         seconds > 0 ? bytes / seconds / 1e6 : 0.0);
+  if (num_slowest > 0) {
+    printf("%12s %12s  %s\n", "replay ms", "recorded ms", "command");
+  }
+  for (int i = 0; i < num_slowest; i++) {
+    printf("%12.3f %12.3f  %s\n", slowest[i].duration / 1e6, slowest[i].original / 1e6, slowest[i].command);
+  }
+  if (scratch[0] != '\0') {
+    printf("Captured files were recreated in %s\n", scratch);
+  }
+}
+
+// Commands that never modify the image. One-shot mode only saves the image after the others.
+int isReadOnlyCommand(char * token[], int token_count){
+  char * read_only[] = { "retrieve", "read", "list", "df", "export", "export-tar", "ioengine", "benchio",
+                         "snapshots", "snapdiff", "delta-export", "trace", "key", NULL };
+  for (int i = 0; read_only[i] != NULL; i++) {
+    if (strcmp(read_only[i], token[0]) == 0) {
+      return 1;
+    }
+  }
+  // fsck only writes when asked to repair
+  if (strcmp(token[0], "fsck") == 0) {
+    return token_count < 2 || token[1] == NULL || strcmp(token[1], "-r") != 0;
+  }
+  return 0;
+}
+
+// Run one tokenized command line against the open image.
+void dispatch(char * token[], int token_count){
+  
+  // promting 'msh' then user does not input anything
+  if (token[0] == NULL){
+    return;
+  }
+
+  // a read-only image only serves commands that leave it unchanged
+  else if (image_read_only && !isReadOnlyCommand(token, token_count) && strcmp("open", token[0]) != 0 &&
+           strcmp("close", token[0]) != 0 && strcmp("createfs", token[0]) != 0 && strcmp("quit", token[0]) != 0 &&
+           strcmp("use", token[0]) != 0 && strcmp("cp", token[0]) != 0) {
+    printf("%s: Image is open read-only\n", token[0]);
+    exit_status = 1;
+    return;
+  }
+
+  else if ((strcmp("insert", token[0]) == 0 )){
+    if (!image_open) {
+      perror("Disk image is not opened\n");
+      return;
+    }
+    if (token[1] == NULL) {
+      perror("No filename specified\n");
+      return;
+    }
+    // several paths, a glob or a directory go through the bulk loader
+    int paths = 0;
+    for (int i = 1; i < token_count; i++) {
+      if (token[i] != NULL) {
+        paths++;
+      }
+    }
+    struct stat buf;
+    // stdin, a FIFO or a character device has no size up front and is streamed
+    if (strcmp(token[1], "-") == 0 && !one_shot) {
+      // at the prompt stdin is the command stream, partly buffered by fgets already
+      printf("insert error: - reads stdin and only works in one-shot mode.\n");
+    }
+    else if (strcmp(token[1], "-") == 0) {
+      insertstreamfs(token[1], token[2]);
+    }
+    else if (paths == 1 && stat(token[1], &buf) == 0 && (S_ISFIFO(buf.st_mode) || S_ISCHR(buf.st_mode))) {
+      insertstreamfs(token[1], token[1]);
+    }
+    else if (paths > 1 || strpbrk(token[1], "*?[") != NULL ||
+        (stat(token[1], &buf) == 0 && S_ISDIR(buf.st_mode))) {
+      insertbatchfs(&token[1], token_count - 1);
+    }
+    else {
+      insertfs(token[1]);
+    }
+  }
+
+  else if ((strcmp("retrieve", token[0]) == 0 )){
+    if (!image_open) {
+      perror("Disk image is not opened\n");
+      return;
+    }
+    // retrieve <file> [<newfile>] & reads a pinned copy in the background
+    int last = token_count - 1;
+    while (last > 0 && token[last] == NULL) {
+      last--;
+    }
+    if (last >= 2 && strcmp(token[last], "&") == 0) {
+      retrievebgfs(token[1], last == 3 ? token[2] : NULL);
+    }
+    else {
+      if (token_count == 2) {
+        retrievefs(token[1], NULL);
+      } 
+      else {
+        retrievefs(token[1], token[2]);
+      }
+    }  
+  }
+
+  else if ((strcmp("export", token[0]) == 0 )){
+    if (!image_open) {
+      perror("Disk image is not opened\n");
+      return;
+    }
+    if (token[1] == NULL) {
+      printf("export: Directory not provided\n");
+      return;
+    }
+    exportfs(token[1], token_count > 2 ? token[2] : NULL);
+  }
+
+  else if ((strcmp("import-tar", token[0]) == 0 ) || (strcmp("export-tar", token[0]) == 0 )){
+    if (!image_open) {
+      perror("Disk image is not opened\n");
+      return;
+    }
+    if (token[1] == NULL) {
+      printf("%s: Archive not provided\n", token[0]);
+      return;
+    }
+    if (token[0][0] == 'i') {
+      importtarfs(token[1]);
+    }
+    else {
+      exporttarfs(token[1]);
+    }
+  }
+
+  else if ((strcmp("ioengine", token[0]) == 0 )){
+    ioenginefs(token_count > 1 ? token[1] : NULL, token_count > 2 ? token[2] : NULL);
+  }
+
+  else if ((strcmp("benchio", token[0]) == 0 )){
+    // the benchmark reads back into the image
+    if (image_read_only) {
+      printf("benchio: Image is open read-only\n");
+      return;
+    }
+    if (token[1] == NULL) {
+      printf("benchio: Scratch file not provided\n");
+      return;
+    }
+    benchiofs(token[1], token_count > 2 && token[2] != NULL && strcmp(token[2], "direct") == 0);
+  }
+
+  else if ((strcmp("snapshot", token[0]) == 0 ) || (strcmp("rollback", token[0]) == 0 ) ||
+           (strcmp("snapdel", token[0]) == 0 )){
+    if (!image_open) {
+      perror("Disk image is not opened\n");
+      return;
+    }
+    if (token[1] == NULL) {
+      printf("%s: Snapshot name not provided\n", token[0]);
+      return;
+    }
+    if (strcmp("snapshot", token[0]) == 0) {
+      snapshotfs(token[1]);
+    }
+    else if (strcmp("rollback", token[0]) == 0) {
+      rollbackfs(token[1]);
+    }
+    else {
+      snapdelfs(token[1]);
+    }
+  }
+
+  else if ((strcmp("snapshots", token[0]) == 0 )){
+    if (!image_open) {
+      perror("Disk image is not opened\n");
+      return;
+    }
+    snapshotsfs();
+  }
+
+  else if ((strcmp("snapdiff", token[0]) == 0 )){
+    if (!image_open) {
+      perror("Disk image is not opened\n");
+      return;
+    }
+    if (token[1] == NULL) {
+      printf("snapdiff: Snapshot name not provided\n");
+      return;
+    }
+    snapdifffs(token[1], token_count > 2 ? token[2] : NULL);
+  }
+
+  else if ((strcmp("write", token[0]) == 0 )){
+    if (!image_open) {
+      perror("Disk image is not opened\n");
+      return;
+    }
+    if (token_count < 4 || token[1] == NULL || token[2] == NULL || token[3] == NULL) {
+      printf("write: Usage: write <file> <offset> <hexbytes|@hostfile>\n");
+      return;
+    }
+    char * end;
+    long long offset = strtoll(token[2], &end, 10);
+    if (end == token[2] || *end != '\0' || offset < 0 || offset >= MAX_FILE_SIZE) {
+      printf("write: Offset must be between 0 and %d\n", MAX_FILE_SIZE - 1);
+      return;
+    }
+    writecmdfs(token[1], offset, token[3]);
+  }
+
+  else if ((strcmp("append", token[0]) == 0 )){
+    if (!image_open) {
+      perror("Disk image is not opened\n");
+      return;
+    }
+    if (token_count < 3 || token[1] == NULL || token[2] == NULL) {
+      printf("append: Usage: append <file> <hexbytes|@hostfile>\n");
+      return;
+    }
+    writecmdfs(token[1], -1, token[2]);
+  }
 
-void encryptfs(char *filename, uint8_t cipher) {
-  // Open the file in read-write binary mode
-  FILE *fp = fopen(filename, "r+b");
-  if (fp == NULL) {
-    printf("Error: File '%s' not found!\n", filename);
-    return;
+  else if ((strcmp("fsck", token[0]) == 0 )){
+    if (!image_open) {
+      perror("Disk image is not opened\n");
+      return;
+    }
+    int repair = token_count > 1 && token[1] != NULL && strcmp(token[1], "-r") == 0;
+    // problems left behind make a one-shot run fail
+    if (fsckfs(repair) > 0 && !repair) {
+      exit_status = 1;
+    }
   }
-  // Get the file size and check if it exceeds the maximum file size
-  fseek(fp, 0L, SEEK_END);
-  int32_t file_size = ftell(fp);
-  fseek(fp, 0L, SEEK_SET);
 
-  if (file_size > MAX_FILE_SIZE) {
-    printf("Error: File '%s' exceeds maximum size of %d bytes!\n", filename, MAX_FILE_SIZE);
-    return;
+  else if ((strcmp("delta-export", token[0]) == 0 )){
+    if (!image_open) {
+      perror("Disk image is not opened\n");
+      return;
+    }
+    if (token_count < 3 || token[1] == NULL || token[2] == NULL) {
+      printf("delta-export: Usage: delta-export <since-generation> <file|->\n");
+      return;
+    }
+    deltaexportfs(strtoul(token[1], NULL, 10), token[2]);
   }
-  // Calculate the number of blocks needed to store the file
-  int32_t blocks_needed = file_size / BLOCK_SIZE + 1;
 
-  int32_t inode_index = -1;
-  int32_t block_index = -1;
-  int32_t inode_block_index = -1;
-  // Find or allocate an inode for the file
-  for (int i = 0; i < NUM_FILES; i++) {
-    if (directory[i].in_use && strcmp(directory[i].filename, filename) == 0) {
-      inode_index = directory[i].inode;
-      break;
+  else if ((strcmp("delta-apply", token[0]) == 0 )){
+    if (!image_open) {
+      perror("Disk image is not opened\n");
+      return;
     }
+    // a delta rewrites blocks in place, pinned or not
+    pinDrain();
+    if (token[1] == NULL) {
+      printf("delta-apply: Delta file not provided\n");
+      return;
+    }
+    deltaapplyfs(token[1]);
   }
 
-  if (inode_index == -1) {
-    inode_index = findFreeInode();
-    if (inode_index == -1) {
-      printf("Error: Could not find free inode to store file '%s'!\n", filename);
+  else if ((strcmp("read", token[0]) == 0 )){
+    if (!image_open) {
+      perror("Disk image is not opened\n");
       return;
     }
-    // then update the directory entry to active
-    directory[inode_index].in_use = 1;
-    directory[inode_index].inode = inode_index;
-    strcpy(directory[inode_index].filename, filename);
-    free_inodes[inode_index] = 0;
+    readfs(token[1],atoi(token[2]),atoi(token[3]));
   }
-  // Allocate blocks for the file 
-  for (int i = 0; i < blocks_needed; i++) {
-    block_index = findFreeBlock();
-    if (block_index == -1) {
-      printf("Error: Could not find free block to store file '%s'!\n", filename);
+
+  else if ((strcmp("delete", token[0]) == 0 )){
+    if (token_count < 2) {
+      printf("Error: missing filename argument\n");
       return;
     }
-    if (i == 0) {
-      inodes[inode_index].blocks[0] = block_index;
-      inodes[inode_index].in_use = 1;
-      inodes[inode_index].attribute = 0;
-      inodes[inode_index].file_size = file_size;
+    if (!image_open) {
+      perror("Disk image is not opened\n");
+      return;
     }
-    else {
-      inode_block_index = findFreeInodeBlock(inode_index);
-      inodes[inode_index].blocks[inode_block_index] = block_index;
+    deletefs(token[1]);
+  }
+
+  else if ((strcmp("undelete", token[0]) == 0 )){
+    if (!image_open) {
+      perror("Disk image is not opened\n");
+      return;
     }
-    free_blocks[block_index - FIRST_DATA_BLOCK] = 0;
-    // Read a block of data from the file and encrypt it
-    uint8_t buf[BLOCK_SIZE];
-    memset(buf, 0, BLOCK_SIZE);
-    fread(buf, 1, BLOCK_SIZE, fp);
-    for (int j = 0; j < BLOCK_SIZE; j++) {
-      buf[j] ^= cipher;
+    if (token_count < 2) {
+      printf("Error: missing filename argument\n");
+      return;
     }
-    // Write the encrypted data back to the file
-    fseek(fp, i * BLOCK_SIZE, SEEK_SET);
-    fwrite(buf, 1, BLOCK_SIZE, fp);
+    undelfs(token[1]);
   }
 
-  fclose(fp);
-  printf("File '%s' encrypted successfully!\n", filename);
-}
-// same as encrypts
-// In XOR cipher, a bitwise XOR operation is performed on the
-// plaintext with a key to generate the ciphertext.
-//To decrypt the ciphertext, the same key is used to perform the XOR operation again
-void decryptfs(char *filename, uint8_t cipher) {
-  FILE *fp = fopen(filename, "r+b");
-  if (fp == NULL) {
-    printf("Error: File '%s' not found!\n", filename);
-    return;
+  else if ((strcmp("trim", token[0]) == 0 )){
+    trimfs(token[1]);
   }
   
-  fseek(fp, 0L, SEEK_END);
-  int32_t file_size = ftell(fp);
-  fseek(fp, 0L, SEEK_SET);
+  else if ((strcmp("list", token[0]) == 0 )){
+    if (!image_open) {
+      perror("Disk image is not opened\n");
+      return;
+    }
+    for (int i = 1; i < token_count; i++) {
+      if (token[i] == NULL) {
+        continue;
+      }
+      if (strcmp(token[i], "-h") == 0) {
+        show_hidden = 1;
+      } else if (strcmp(token[i], "-a") == 0) {
+        show_attributes = 1;
+      }
+    }
+    listfs();
+    show_hidden = 0;
+    show_attributes = 0;
+  }
 
-  if (file_size > MAX_FILE_SIZE) {
-    printf("Error: File '%s' exceeds maximum size of %d bytes!\n", filename, MAX_FILE_SIZE);
-    return;
+  else if ((strcmp("df", token[0]) == 0 )){
+    if (!image_open){
+      perror("Disk image is not opened\n");
+      return;
+    }
+    printf("%d bytes free\n", dffs());
+    long logical = 0;
+    long allocated = 0;
+    for (int i = 0; i < NUM_FILES; i++) {
+      if (directory[i].in_use) {
+        logical += inodes[directory[i].inode].file_size;
+        allocated += (long) allocatedBlocks(&inodes[directory[i].inode]) * BLOCK_SIZE;
+      }
+    }
+    printf("%ld bytes in files, %ld bytes allocated\n", logical, allocated);
   }
 
-  int32_t blocks_needed = file_size / BLOCK_SIZE + 1;
+  else if ((strcmp("open", token[0]) == 0 )){
+    int read_only = token[1] != NULL && strcmp(token[1], "-ro") == 0;
+    if (token[1 + read_only] == NULL) {
+      perror("No filename specified\n");
+      return;
+    }
+    // open <image> as <alias> opens it next to the images already open
+    if (token[2 + read_only] != NULL && strcmp(token[2 + read_only], "as") == 0) {
+      if (token[3 + read_only] == NULL) {
+        printf("open: No alias specified\n");
+        return;
+      }
+      mountOpen(token[1 + read_only], read_only, token[3 + read_only]);
+      return;
+    }
+    openfs(token[1 + read_only], read_only);
+  }
 
-  int32_t inode_index = -1;
-  int32_t block_index = -1;
-  int32_t inode_block_index = -1;
+  else if ((strcmp("close", token[0]) == 0 )){
+    mountClose();
+  }
 
-  for (int i = 0; i < NUM_FILES; i++) {
-    if (directory[i].in_use && strcmp(directory[i].filename, filename) == 0) {
-      inode_index = directory[i].inode;
-      break;
+  else if ((strcmp("use", token[0]) == 0 )){
+    usefs(token[1]);
+  }
+
+  else if ((strcmp("cp", token[0]) == 0 )){
+    if (token[1] == NULL || token[2] == NULL) {
+      printf("cp: Expected [<alias>:]<file> [<alias>:]<file>\n");
+      return;
     }
+    cpfs(token[1], token[2]);
   }
 
-  if (inode_index == -1) {
-    inode_index = findFreeInode();
-    if (inode_index == -1) {
-      printf("Error: Could not find free inode to store file '%s'!\n", filename);
+  else if ((strcmp("createfs", token[0]) == 0 )){
+    if (token[1] == NULL) {
+      perror("No filename specified\n");
       return;
     }
-    directory[inode_index].in_use = 1;
-    directory[inode_index].inode = inode_index;
-    strcpy(directory[inode_index].filename, filename);
-    free_inodes[inode_index] = 0;
+    createfs(token[1]);
   }
 
-  for (int i = 0; i < blocks_needed; i++) {
-    block_index = findFreeBlock();
-    if (block_index == -1) {
-      printf("Error: Could not find free block to store file '%s'!\n", filename);
+  else if ((strcmp("savefs", token[0]) == 0 )){
+    // --compact and --flat convert the image file; without either it keeps its format
+    if (token[1] != NULL && strcmp(token[1], "--compact") != 0 && strcmp(token[1], "--flat") != 0) {
+      printf("savefs: Expected --compact or --flat\n");
       return;
     }
-    if (i == 0) {
-      inodes[inode_index].blocks[0] = block_index;
-      inodes[inode_index].in_use = 1;
-      inodes[inode_index].attribute = 0;
-      inodes[inode_index].file_size = file_size;
+    if (token[1] != NULL && strcmp(token[1], "--compact") == 0 && autosave_enabled) {
+      printf("savefs: Autosave does not checkpoint compact images; turn it off first\n");
+      return;
+    }
+    int compact = image_compact;
+    if (token[1] != NULL && image_open) {
+      image_compact = strcmp(token[1], "--compact") == 0;
+    }
+    // a failed save leaves the file in its old format, and autosave must keep to it
+    if (savefs() == -1) {
+      image_compact = compact;
+    }
+  }
+  
+  else if ((strcmp("attrib", token[0]) == 0 )){
+    // att = 1 -> h attribute
+    // att = 2 -> r attribute
+    // set = 1 -> +
+    // set = 0 -> -
+    int set = 1;
+    int att = 0;
+    if (strcmp(token[1], "+h") == 0) {
+      att = 1;
+      set = 1;
+      attribfs(token[2], att,set);
+    }
+    else if (strcmp(token[1], "-h") == 0) {
+      att = 1;
+      set = 0;
+      attribfs(token[2], att,set);
+    }
+    else if (strcmp(token[1], "+r") == 0) {
+      att = 2;
+      set = 1;
+      attribfs(token[2], att,set);
+    }
+    else if (strcmp(token[1], "-r") == 0) {
+      att = 2;
+      set = 0;
+      attribfs(token[2], att,set);
+    }
+    // att = 3 -> e attribute, which needs the key
+    else if ((strcmp(token[1], "+e") == 0 || strcmp(token[1], "-e") == 0) && !master_key_loaded) {
+      printf("attrib: No key is loaded\n");
+    }
+    else if (strcmp(token[1], "+e") == 0) {
+      att = 3;
+      set = 1;
+      attribfs(token[2], att,set);
+    }
+    else if (strcmp(token[1], "-e") == 0) {
+      att = 3;
+      set = 0;
+      attribfs(token[2], att,set);
+    }
+  }
+
+  else if ((strcmp("key", token[0]) == 0 )){
+    if (token[1] == NULL) {
+      printf(master_key_loaded ? "A key is loaded\n" : "No key is loaded\n");
+    }
+    else if (strcmp(token[1], "off") == 0) {
+      memset(&master_key, 0, sizeof(master_key));
+      master_key_loaded = 0;
     }
     else {
-      inode_block_index = findFreeInodeBlock(inode_index);
-      inodes[inode_index].blocks[inode_block_index] = block_index;
+      loadKey(token[1]);
     }
-    free_blocks[block_index - FIRST_DATA_BLOCK] = 0;
+  }
 
-    uint8_t buf[BLOCK_SIZE];
-    memset(buf, 0, BLOCK_SIZE);
-    fread(buf, 1, BLOCK_SIZE, fp);
-    for (int j = 0; j < BLOCK_SIZE; j++) {
-      buf[j] ^= cipher;
+  else if ((strcmp("encrypt", token[0]) == 0 )){
+    encryptfs(token[1], atoi(token[2]));
+  } 
+  
+
+  else if ((strcmp("decrypt", token[0]) == 0 )){
+    decryptfs(token[1], atoi(token[2]));
+  } 
+
+  else if ((strcmp("trace", token[0]) == 0 )){
+    if (token[1] == NULL) {
+      printf(trace_fd != -1 ? "Recording a trace\n" : "Not recording a trace\n");
+      return;
     }
-    fseek(fp, i * BLOCK_SIZE, SEEK_SET);
-    fwrite(buf, 1, BLOCK_SIZE, fp);
+    if (strcmp(token[1], "off") == 0) {
+      traceStop();
+      return;
+    }
+    int capture = strcmp(token[1], "-c") == 0;
+    if (token[1 + capture] == NULL) {
+      printf("trace: No trace file specified\n");
+      return;
+    }
+    traceStart(token[1 + capture], capture);
   }
 
-  fclose(fp);
-  printf("File '%s' decrypted successfully!\n", filename);
-}
+  else if ((strcmp("replay", token[0]) == 0 )){
+    if (image_open == 0) {
+      perror("Disk image is not opened\n");
+      return;
+    }
+    int paced = token[1] != NULL && strcmp(token[1], "-p") == 0;
+    if (token[1 + paced] == NULL) {
+      printf("replay: No trace file specified\n");
+      return;
+    }
+    replayfs(token[1 + paced], paced);
+  }
+
+  else if ((strcmp("autosave", token[0]) == 0 )){
+    if (image_read_only) {
+      printf("autosave: Image is open read-only\n");
+      return;
+    }
+    autosavefs(token[1], token[1] != NULL ? token[2] : NULL);
+  }
 
+  // compare the current command line with 'quit', if equals, exit with zero status
+  else if ((strcmp("quit", token[0]) == 0)){
+    pinDrain();
+    mountFinish();
+    autosaveFinish();
+    autosaveStop();
+    exit(0);
+  }
 
+  else {
+    printf("Invalid command! Try Again!\n");
+    return;
+  }
+}
 
-int main(){
+int main(int argc, char * argv[]){
 
   char * command_string = (char*) malloc( MAX_COMMAND_SIZE );
   file = NULL;
+  cpuDetect();
   initialization();
+
+  // One-shot mode: mfs [-ro] <image> <command> [args...] runs a single command against
+  // the image, saving it afterwards if the command can modify it. This leaves stdin and
+  // stdout free for commands that stream, e.g. mfs a.img export-tar - | gzip
+  int read_only = argc > 1 && strcmp(argv[1], "-ro") == 0;
+  if (argc > 2 + read_only) {
+    if (getenv("MFS_KEY") != NULL && loadKey(getenv("MFS_KEY")) == -1) {
+      return 1;
+    }
+    if (getenv("MFS_TRACE") != NULL) {
+      traceStart(getenv("MFS_TRACE"), getenv("MFS_TRACE_CAPTURE") != NULL);
+    }
+    openfs(argv[1 + read_only], read_only);
+    if (!image_open) {
+      return 1;
+    }
+    one_shot = 1;
+    char * token[MAX_NUM_ARGUMENTS];
+    int token_count = 0;
+    for (int i = 2 + read_only; i < argc && token_count < MAX_NUM_ARGUMENTS; i++) {
+      token[token_count++] = argv[i];
+    }
+    for (int i = token_count; i < MAX_NUM_ARGUMENTS; i++) {
+      token[i] = NULL;
+    }
+    // commands run holding image_mutex, as at the prompt: background readers take it too
+    pthread_mutex_lock(&image_mutex);
+    traceDispatch(token, token_count);
+    pinDrain();
+    if (!read_only) {
+      commitGeneration();
+      // a failed command leaves the image file as it was
+      if (!isReadOnlyCommand(token, token_count) && !exit_status) {
+        savefs();
+      }
+    }
+    pthread_mutex_unlock(&image_mutex);
+    return exit_status;
+  }
     
+  // Commands run holding image_mutex; the autosave thread takes its snapshots while the
+  // prompt waits for input.
+  pthread_mutex_lock(&image_mutex);
   // reuse code from mav shell assignment
   while( 1 ){
   // Print out the msh prompt
     printf ("mfs> ");
+    fflush(stdout);
+    pthread_mutex_unlock(&image_mutex);
     // Read the command from the commandline.  The
     // maximum command that will be read is MAX_COMMAND_SIZE
     // This while command will wait here until the user
     // inputs something since fgets returns NULL when there
     // is no input
     while( !fgets (command_string, MAX_COMMAND_SIZE, stdin) );
+    pthread_mutex_lock(&image_mutex);
     /* Parse input */
     char *token[MAX_NUM_ARGUMENTS];
     for( int i = 0; i < MAX_NUM_ARGUMENTS; i++ ){
@@ -727,168 +6045,11 @@ int main(){
       token_count++;
     }
 
-    // Command 
-    
-    // promting 'msh' then user does not input anything
-    if (token[0] == NULL){
-      continue;
-    }
-
-    else if ((strcmp("insert", token[0]) == 0 )){
-      if (!image_open) {
-        perror("Disk image is not opened\n");
-        continue;
-      }
-      if (token[1] == NULL) {
-        perror("No filename specified\n");
-        continue;
-      }
-      insertfs(token[1]);
-    }
-
-    else if ((strcmp("retrieve", token[0]) == 0 )){
-      if (!image_open) {
-        perror("Disk image is not opened\n");
-        continue;
-      }
-      else {
-        if (token_count == 2) {
-          retrievefs(token[1], NULL);
-        } 
-        else {
-          retrievefs(token[1], token[2]);
-        }
-      }  
-    }
-
-    else if ((strcmp("read", token[0]) == 0 )){
-      if (!image_open) {
-        perror("Disk image is not opened\n");
-        continue;
-      }
-      readfs(token[1],atoi(token[2]),atoi(token[3]));
-    }
-
-    else if ((strcmp("delete", token[0]) == 0 )){
-      if (token_count < 2) {
-        printf("Error: missing filename argument\n");
-        continue;
-      }
-      if (!image_open) {
-        perror("Disk image is not opened\n");
-        continue;
-      }
-      deletefs(token[1]);
-    }
-
-    else if ((strcmp("undelete", token[0]) == 0 )){
-      if (!image_open) {
-        perror("Disk image is not opened\n");
-        continue;
-      }
-      if (token_count < 2) {
-        printf("Error: missing filename argument\n");
-        continue;
-      }
-      undelfs(token[1]);
-    }
-    
-    else if ((strcmp("list", token[0]) == 0 )){
-      if (!image_open) {
-        perror("Disk image is not opened\n");
-        continue;
-      }
-      for (int i = 1; i < token_count; i++) {
-        if (strcmp(token[i], "-h") == 0) {
-          show_hidden = 1;
-        } else if (strcmp(token[i], "-a") == 0) {
-          show_attributes = 1;
-        }
-      }
-      listfs();
-      show_hidden = 0;
-      show_attributes = 0;
-    }
-
-    else if ((strcmp("df", token[0]) == 0 )){
-      if (!image_open){
-        perror("Disk image is not opened\n");
-        continue;
-      }
-      printf("%d bytes free\n", dffs());
-    }
-
-    else if ((strcmp("open", token[0]) == 0 )){
-      if (token[1] == NULL) {
-        perror("No filename specified\n");
-        continue;
-      }
-      openfs(token[1]);
-    }
-
-    else if ((strcmp("close", token[0]) == 0 )){
-      closefs();
-    }
-
-    else if ((strcmp("createfs", token[0]) == 0 )){
-      if (token[1] == NULL) {
-        perror("No filename specified\n");
-        continue;
-      }
-      createfs(token[1]);
-    }
-
-    else if ((strcmp("savefs", token[0]) == 0 )){
-      savefs();
-    }
-    
-    else if ((strcmp("attrib", token[0]) == 0 )){
-      // att = 1 -> h attribute
-      // att = 2 -> r attribute
-      // set = 1 -> +
-      // set = 0 -> -
-      int set = 1;
-      int att = 0;
-      if (strcmp(token[1], "+h") == 0) {
-        att = 1;
-        set = 1;
-        attribfs(token[2], att,set);
-      }
-      else if (strcmp(token[1], "-h") == 0) {
-        att = 1;
-        set = 0;
-        attribfs(token[2], att,set);
-      }
-      else if (strcmp(token[1], "+r") == 0) {
-        att = 2;
-        set = 1;
-        attribfs(token[2], att,set);
-      }
-      else if (strcmp(token[1], "-r") == 0) {
-        att = 2;
-        set = 0;
-        attribfs(token[2], att,set);
-      }  
-    }
-
-    else if ((strcmp("encrypt", token[0]) == 0 )){
-      encryptfs(token[1], atoi(token[2]));
-    } 
-    
-
-    else if ((strcmp("decrypt", token[0]) == 0 )){
-      decryptfs(token[1], atoi(token[2]));
-    } 
-
-    // compare the current command line with 'quit', if equals, exit with zero status
-    else if ((strcmp("quit", token[0]) == 0)){
-      exit(0);
-    }
-
-    else {
-      printf("Invalid command! Try Again!\n");
-      continue;
+    traceDispatch(token, token_count);
+    if (image_open && !image_read_only) {
+      commitGeneration();
     }
+    autosaveCheck();
 
     //___________________________________________________________________________________________________________________________//  
 
@@ -0,0 +1,303 @@
+// mvcc_stress [<seconds>] [<readers>]: reader threads pin and check random files of a
+// scratch image, first on their own and then while this thread rewrites files in place
+// and deletes and recreates them, closing a generation after each and saving the image
+// now and then. Every file holds a pattern of its version and length, so a torn read
+// shows. Reports read latency in both phases, and fails on a torn read or when fsck
+// finds problems in the image in memory or in the file last saved under the readers.
+//
+// Built with filesystem.c compiled in, its main renamed: make -C tests check
+
+#define main mfsMain
+#include "../filesystem.c"
+#undef main
+
+#define STRESS_FILES 16
+#define STRESS_SAMPLES (1 << 20)
+#define STRESS_SAVE_EVERY 64 // writes between saves
+
+struct _stressReader {
+  pthread_t thread;
+  unsigned int seed;
+  int64_t reads[2];
+  int64_t torn;
+  int32_t samples[2];
+  float * latency[2]; // microseconds
+};
+
+_Atomic int stress_phase = 0; // 0: readers alone, 1: with the writer, 2: stop
+
+void stressFill(uint8_t * buf, uint32_t file, uint32_t version, uint32_t len){
+  for (uint32_t w = 0; w * 8 < len; w++) {
+    uint64_t word = w == 0 ? ((uint64_t) version << 32 | file)
+                  : w == 1 ? len
+                  : ((uint64_t) version << 32 | w) * 0x9e3779b97f4a7c15ULL ^ file;
+    memcpy(buf + w * 8, &word, len - w * 8 < 8 ? len - w * 8 : 8);
+  }
+}
+
+// Whether buf holds a whole version of the file.
+int stressCheck(uint8_t * buf, uint8_t * expected, uint32_t file, uint32_t len){
+  uint64_t header;
+  if (len < 16) {
+    return 0;
+  }
+  memcpy(&header, buf, 8);
+  stressFill(expected, file, header >> 32, len);
+  return memcmp(buf, expected, len) == 0;
+}
+
+uint32_t stressLength(unsigned int * seed){
+  // a quarter of them are inline
+  uint32_t r = rand_r(seed);
+  return r % 4 == 0 ? 16 + r % (INLINE_MAX_SIZE - 16) : INLINE_MAX_SIZE + 1 + r % (256 * 1024);
+}
+
+int stressCreate(char * name, uint32_t file, uint32_t version, uint32_t len, uint8_t * buf){
+  int32_t entry = -1;
+  for (int i = 0; i < NUM_FILES && entry == -1; i++) {
+    if (!directory[i].in_use) {
+      entry = i;
+    }
+  }
+  int32_t inode_index = findFreeInode();
+  if (entry == -1 || inode_index == -1) {
+    return -1;
+  }
+  // an empty inline file, which the write fills
+  memset(&inodes[inode_index], 0, sizeof(struct inode));
+  inodes[inode_index].in_use = 1;
+  inodes[inode_index].attribute = INLINE;
+  free_inodes[inode_index] = 0;
+  memset(&directory[entry], 0, sizeof(directory[0]));
+  strcpy(directory[entry].filename, name);
+  directory[entry].inode = inode_index;
+  directory[entry].in_use = 1;
+  stressFill(buf, file, version, len);
+  return writefs(name, 0, buf, len);
+}
+
+void * stressReaderWorker(void * arg){
+  struct _stressReader * reader = (struct _stressReader *) arg;
+  uint8_t * buf = (uint8_t *) malloc(MAX_FILE_SIZE);
+  uint8_t * expected = (uint8_t *) malloc(MAX_FILE_SIZE);
+  int phase;
+  while ((phase = atomic_load(&stress_phase)) < 2) {
+    uint32_t file = rand_r(&reader->seed) % STRESS_FILES;
+    char name[16];
+    snprintf(name, sizeof(name), "mvcc%u", file);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&image_mutex);
+    int32_t entry = findDirectoryEntry(name);
+    struct _pin pin;
+    if (entry == -1 || pinFile(entry, &pin) == -1) {
+      pthread_mutex_unlock(&image_mutex);
+      continue;
+    }
+    pthread_mutex_unlock(&image_mutex);
+    pinRead(&pin, 0, buf, pin.node.file_size);
+    int whole = stressCheck(buf, expected, file, pin.node.file_size);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_mutex_lock(&image_mutex);
+    unpinFile(&pin);
+    pthread_mutex_unlock(&image_mutex);
+    reader->reads[phase]++;
+    reader->torn += !whole;
+    if (reader->samples[phase] < STRESS_SAMPLES) {
+      reader->latency[phase][reader->samples[phase]++] =
+        (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+    }
+  }
+  free(buf);
+  free(expected);
+  return NULL;
+}
+
+int compareFloat(const void * a, const void * b){
+  float x = *(const float *) a;
+  float y = *(const float *) b;
+  return (x > y) - (x < y);
+}
+
+void stressReport(char * label, struct _stressReader * readers, int count, int phase){
+  int64_t reads = 0;
+  int32_t samples = 0;
+  for (int r = 0; r < count; r++) {
+    reads += readers[r].reads[phase];
+    samples += readers[r].samples[phase];
+  }
+  float * all = (float *) malloc((samples + 1) * sizeof(float));
+  for (int r = 0, at = 0; r < count; r++) {
+    memcpy(all + at, readers[r].latency[phase], readers[r].samples[phase] * sizeof(float));
+    at += readers[r].samples[phase];
+  }
+  qsort(all, samples, sizeof(float), compareFloat);
+  printf("  %-20s %8lld reads, p50 %8.1f us, p99 %8.1f us, max %8.1f us\n", label, (long long) reads,
+         samples ? all[samples / 2] : 0, samples ? all[(int64_t) samples * 99 / 100] : 0,
+         samples ? all[samples - 1] : 0);
+  free(all);
+}
+
+// Remove the image and the files kept next to it.
+void stressCleanup(char * dir, char * image){
+  char path[PATH_MAX];
+  char * suffixes[] = { "", ".snaps", ".gen", ".lock", ".tmp", ".ckpt" };
+  for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+    snprintf(path, PATH_MAX, "%s%s", image, suffixes[i]);
+    unlink(path);
+  }
+  rmdir(dir);
+}
+
+int main(int argc, char * argv[]){
+  int seconds = argc > 1 ? atoi(argv[1]) : 4;
+  int count = argc > 2 ? atoi(argv[2]) : 4;
+  if (seconds <= 0 || count <= 0 || count > 64) {
+    printf("usage: mvcc_stress [<seconds>] [<readers, up to 64>]\n");
+    return 2;
+  }
+  // image names are kept in 64 bytes
+  char * tmp = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+  char dir[48];
+  char image[64];
+  if (snprintf(dir, sizeof(dir), "%s/mfs-mvcc-XXXXXX", tmp) >= (int) sizeof(dir) || mkdtemp(dir) == NULL) {
+    printf("mvcc_stress: No scratch directory in %s\n", tmp);
+    return 2;
+  }
+  snprintf(image, sizeof(image), "%s/stress.img", dir);
+  cpuDetect();
+  initialization();
+  // as at the prompt, this thread holds image_mutex unless it waits for the readers
+  pthread_mutex_lock(&image_mutex);
+  createfs(image);
+  if (!image_open) {
+    stressCleanup(dir, image);
+    return 2;
+  }
+  char name[16];
+  uint32_t versions[STRESS_FILES];
+  uint8_t * buf = (uint8_t *) malloc(MAX_FILE_SIZE);
+  unsigned int seed = time(NULL);
+  // the writer's commands print as they go
+  fflush(stdout);
+  int saved_stdout = dup(STDOUT_FILENO);
+  int null_fd = open("/dev/null", O_WRONLY);
+  if (null_fd != -1) {
+    dup2(null_fd, STDOUT_FILENO);
+  }
+  int ready = 1;
+  for (uint32_t f = 0; f < STRESS_FILES && ready; f++) {
+    snprintf(name, sizeof(name), "mvcc%u", f);
+    versions[f] = 1;
+    ready = stressCreate(name, f, versions[f], stressLength(&seed), buf) == 0;
+  }
+  commitGeneration();
+  uint32_t first_generation = generation;
+  struct _stressReader * readers = (struct _stressReader *) calloc(count, sizeof(struct _stressReader));
+  int64_t writes = 0;
+  int saves = 0;
+  int save_failed = 0;
+  if (ready) {
+    for (int r = 0; r < count; r++) {
+      readers[r].seed = seed + r + 1;
+      readers[r].latency[0] = (float *) malloc(STRESS_SAMPLES * sizeof(float));
+      readers[r].latency[1] = (float *) malloc(STRESS_SAMPLES * sizeof(float));
+      pthread_create(&readers[r].thread, NULL, stressReaderWorker, &readers[r]);
+    }
+    // readers alone
+    pthread_mutex_unlock(&image_mutex);
+    struct timespec pause = { seconds / 2, (seconds % 2) * 500000000L };
+    nanosleep(&pause, NULL);
+    pthread_mutex_lock(&image_mutex);
+    atomic_store(&stress_phase, 1);
+    struct timespec now, end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += seconds - seconds / 2;
+    do {
+      uint32_t f = rand_r(&seed) % STRESS_FILES;
+      snprintf(name, sizeof(name), "mvcc%u", f);
+      int32_t entry = findDirectoryEntry(name);
+      versions[f]++;
+      // every so often the version being replaced stays pinned over a save, which must
+      // write the blocks only that pin holds as free
+      int save = writes % STRESS_SAVE_EVERY == 0;
+      struct _pin held;
+      int holding = save && entry != -1 && pinFile(entry, &held) == 0;
+      if (entry != -1 && rand_r(&seed) % 2 == 0) {
+        // a new version in place: pinned blocks are copied first
+        uint32_t len = inodes[directory[entry].inode].file_size;
+        stressFill(buf, f, versions[f], len);
+        writefs(name, 0, buf, len);
+      }
+      else {
+        // a new file: the blocks of the old one stay while they are pinned
+        if (entry != -1) {
+          deletefs(name);
+        }
+        stressCreate(name, f, versions[f], stressLength(&seed), buf);
+      }
+      commitGeneration();
+      writes++;
+      if (save) {
+        save_failed = savefs() == -1 || save_failed;
+        saves++;
+      }
+      if (holding) {
+        unpinFile(&held);
+      }
+      // let the readers pin between writes
+      pthread_mutex_unlock(&image_mutex);
+      sched_yield();
+      pthread_mutex_lock(&image_mutex);
+      clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (now.tv_sec < end.tv_sec || (now.tv_sec == end.tv_sec && now.tv_nsec < end.tv_nsec));
+    atomic_store(&stress_phase, 2);
+    pthread_mutex_unlock(&image_mutex);
+    for (int r = 0; r < count; r++) {
+      pthread_join(readers[r].thread, NULL);
+    }
+    pthread_mutex_lock(&image_mutex);
+  }
+  fflush(stdout);
+  if (saved_stdout != -1) {
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+  }
+  if (null_fd != -1) {
+    close(null_fd);
+  }
+  int failed = 1;
+  if (!ready) {
+    printf("mvcc_stress: Not enough room for %d files\n", STRESS_FILES);
+  }
+  else {
+    int64_t torn = 0;
+    for (int r = 0; r < count; r++) {
+      torn += readers[r].torn;
+    }
+    printf("mvcc_stress: %d readers, %d files, %lld writes over %u generations, %d saves\n", count,
+           STRESS_FILES, (long long) writes, generation - first_generation, saves);
+    stressReport("readers alone", readers, count, 0);
+    stressReport("with the writer", readers, count, 1);
+    printf("  %lld torn reads\n", (long long) torn);
+    // every pin is gone, so the free map must agree with the files again
+    int problems = fsckfs(0);
+    // and the file saved last must hold no block that only a reader kept
+    openfs(image, 1);
+    int saved_problems = image_open ? fsckfs(0) : 1;
+    failed = torn > 0 || problems > 0 || saved_problems > 0 || save_failed;
+  }
+  if (image_open) {
+    closefs();
+  }
+  pthread_mutex_unlock(&image_mutex);
+  stressCleanup(dir, image);
+  for (int r = 0; r < count; r++) {
+    free(readers[r].latency[0]);
+    free(readers[r].latency[1]);
+  }
+  free(readers);
+  free(buf);
+  printf("mvcc_stress: %s\n", failed ? "FAILED" : "passed");
+  return failed;
+}